@@ -15,13 +15,56 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include "client.h"
 
+/* Connects to the unix socket at path */
+static int connect_path(const char *path) {
+  struct sockaddr_un addr;
+  int sock;
+
+  sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static int write_all(int sock, const char *buf, size_t len) {
+  ssize_t size;
+
+  while (len) {
+    size = send(sock, buf, len, MSG_NOSIGNAL);
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size < 0) {
+      perror("send");
+      return -1;
+    }
+    buf += size;
+    len -= size;
+  }
+  return 0;
+}
+
 int bcc_send_fd(int sock, int fd) {
   ssize_t size;
   int cl = -1;
@@ -73,69 +116,213 @@ cleanup:
   return 0;
 }
 
-int bcc_recv_fd(const char *path) {
-  ssize_t size;
-  int fd = -1, sock = -1;
+int bcc_fd_connect(const char *mount) {
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+  if ((size_t)snprintf(path, sizeof(path), "%s/%s", mount, BCC_CONTROL_SOCKET) >= sizeof(path)) {
+    fprintf(stderr, "%s: path too long\n", mount);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return connect_path(path);
+}
+
+int bcc_fd_request(int sock, const char *const *paths, int n) {
+  char *req;
+  size_t len = 0;
+  int i, rc;
+
+  for (i = 0; i < n; ++i) {
+    if (!paths[i][0] || strchr(paths[i], '\n')) {
+      errno = EINVAL;
+      return -1;
+    }
+    len += strlen(paths[i]) + 1;
+  }
+  req = malloc(len + 1);
+  if (!req) {
+    perror("malloc");
+    return -1;
+  }
+  len = 0;
+  for (i = 0; i < n; ++i) {
+    strcpy(req + len, paths[i]);
+    len += strlen(paths[i]);
+    req[len++] = '\n';
+  }
+  req[len++] = '\n';
+  rc = write_all(sock, req, len);
+  free(req);
+  return rc;
+}
+
+int bcc_fd_reply(int sock, int *fds, int n) {
+  int32_t *status;
+  int *recvd;
+  size_t have = 0;
+  int nrecvd = 0, rc = -1, i, j;
   union {
     struct cmsghdr cmsghdr;
-    char control[CMSG_SPACE(sizeof(int))];
+    char control[CMSG_SPACE(sizeof(int) * 64)];
   } cmsgu;
   struct cmsghdr *cmsg;
+  struct iovec iov;
+  struct msghdr msg;
+  ssize_t size;
 
-  char buf[4];
-  struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
-
-  struct msghdr msg = {
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = cmsgu.control,
-    .msg_controllen = sizeof(cmsgu.control),
-    .msg_name = NULL,
-    .msg_namelen = 0,
-  };
-  cmsgu.cmsghdr.cmsg_len = CMSG_LEN(sizeof(fd));
-  cmsgu.cmsghdr.cmsg_level = SOL_SOCKET;
-  cmsgu.cmsghdr.cmsg_type = SCM_RIGHTS;
-
-  sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (sock < 0) {
-    perror("socket");
+  if (n <= 0)
+    return 0;
+  status = malloc(sizeof(*status) * n);
+  recvd = malloc(sizeof(*recvd) * n);
+  if (!status || !recvd) {
+    perror("malloc");
     goto cleanup;
   }
-  struct sockaddr_un addr;
-  memset(&addr, 0, sizeof(addr));
-  addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, path, sizeof(addr.sun_path));
 
-  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("connect");
-    goto cleanup;
+  /* Statuses and fds come in order, but not necessarily together. Reading
+   * no further than this reply leaves the fds of the next one alone. */
+  while (have < sizeof(*status) * n) {
+    iov.iov_base = (char *)status + have;
+    iov.iov_len = sizeof(*status) * n - have;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgu.control;
+    msg.msg_controllen = sizeof(cmsgu.control);
+    size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size <= 0) {
+      if (size < 0)
+        perror("recvmsg");
+      else
+        fprintf(stderr, "recvmsg: short response\n");
+      goto cleanup;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      for (j = 0; j < (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); ++j) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + j * sizeof(int), sizeof(fd));
+        if (nrecvd < n)
+          recvd[nrecvd++] = fd;
+        else
+          close(fd);
+      }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+      fprintf(stderr, "recvmsg: control data truncated\n");
+      goto cleanup;
+    }
+    have += size;
   }
 
-  size = recvmsg(sock, &msg, 0);
-  if (size < 0) {
-    perror("recvmsg");
+  for (i = 0, j = 0; i < n; ++i)
+    j += status[i] == 0;
+  if (j != nrecvd) {
+    fprintf(stderr, "recvmsg: %d fds for %d paths\n", nrecvd, j);
     goto cleanup;
   }
-  cmsg = CMSG_FIRSTHDR(&msg);
-  if (!cmsg || cmsg->cmsg_len != CMSG_LEN(sizeof(fd))) {
-    fprintf(stderr, "recvmsg: invalid control response\n");
-    goto cleanup;
+  for (i = 0, j = 0; i < n; ++i) {
+    if (status[i] == 0)
+      fds[i] = recvd[j++];
+    else
+      fds[i] = status[i] < 0 ? status[i] : -EIO;
   }
-  if (cmsg->cmsg_level != SOL_SOCKET) {
-    fprintf(stderr, "recvmsg: invalid cmsg_level %d\n", cmsg->cmsg_level);
-    goto cleanup;
+  rc = 0;
+
+cleanup:
+  if (rc < 0) {
+    for (i = 0; i < nrecvd; ++i)
+      close(recvd[i]);
   }
-  if (cmsg->cmsg_type != SCM_RIGHTS) {
-    fprintf(stderr, "recvmsg: invalid cmsg_type %d\n", cmsg->cmsg_type);
+  free(status);
+  free(recvd);
+  return rc;
+}
+
+int bcc_recv_fds(const char *mount, const char *const *paths, int *fds, int n) {
+  const char **sent = NULL;
+  int *idx = NULL, *got = NULL;
+  int sock = -1, nsent = 0, rc = -1, i;
+
+  if (n <= 0)
+    return 0;
+  sent = malloc(sizeof(*sent) * n);
+  idx = malloc(sizeof(*idx) * n);
+  got = malloc(sizeof(*got) * n);
+  if (!sent || !idx || !got) {
+    perror("malloc");
     goto cleanup;
   }
-
-  fd = *((int *)CMSG_DATA(cmsg));
+  /* paths that can not be put in a request fail on their own */
+  for (i = 0; i < n; ++i) {
+    if (!paths[i][0] || strchr(paths[i], '\n')) {
+      fds[i] = -EINVAL;
+      continue;
+    }
+    sent[nsent] = paths[i];
+    idx[nsent++] = i;
+  }
+  if (nsent) {
+    sock = bcc_fd_connect(mount);
+    if (sock < 0 || bcc_fd_request(sock, sent, nsent) < 0 ||
+        bcc_fd_reply(sock, got, nsent) < 0)
+      goto cleanup;
+  }
+  for (i = 0; i < nsent; ++i)
+    fds[idx[i]] = got[i];
+  rc = 0;
 
 cleanup:
   if (sock >= 0)
     close(sock);
+  free(sent);
+  free(idx);
+  free(got);
+  return rc;
+}
+
+int bcc_recv_fd(const char *path) {
+  char target[PATH_MAX], control[PATH_MAX + sizeof(BCC_CONTROL_SOCKET)];
+  const char *rel;
+  struct stat st;
+  size_t len, root;
+  int fd = -1;
+
+  len = strlen(path);
+  if (len >= sizeof(target)) {
+    fprintf(stderr, "%s: path too long\n", path);
+    return -1;
+  }
+  strcpy(target, path);
+  while (len > 1 && target[len - 1] == '/')
+    target[--len] = '\0';
+  /* a map or function stands for the fd socket it used to have */
+  if (len > 3 && !strcmp(target + len - 3, "/fd"))
+    target[len -= 3] = '\0';
 
+  /* the mount root is the closest directory up with a control socket */
+  for (root = len;; --root) {
+    while (root > 0 && target[root] != '/')
+      --root;
+    if (!root) {
+      fprintf(stderr, "%s: no %s above it\n", path, BCC_CONTROL_SOCKET);
+      return -1;
+    }
+    snprintf(control, sizeof(control), "%.*s/%s", (int)root, target, BCC_CONTROL_SOCKET);
+    if (!stat(control, &st) && S_ISSOCK(st.st_mode))
+      break;
+  }
+  target[root] = '\0';
+  rel = target + root + 1;
+
+  if (bcc_recv_fds(target, &rel, &fd, 1) < 0)
+    return -1;
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(-fd));
+    return -1;
+  }
   return fd;
 }
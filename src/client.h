@@ -17,13 +17,61 @@
 #ifndef BCC_CLIENT_H
 #define BCC_CLIENT_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define BCC_DUMP_MAGIC "BCCDUMP1"
+
+/* Start of a map's dump.bin. It is followed by key_desc_len bytes of key
+ * type description and leaf_desc_len bytes of leaf type description, as
+ * printed by libbcc, then padding up to header_size. After that come count
+ * records of key_size bytes of key and leaf_size bytes of leaf. All fields
+ * are in host byte order. */
+struct bcc_dump_header {
+  char magic[8];
+  uint32_t header_size;
+  uint32_t key_size;
+  uint32_t leaf_size;
+  uint32_t key_desc_len;
+  uint32_t leaf_desc_len;
+  uint32_t reserved;
+  uint64_t count;
+};
+
 int bcc_send_fd(int sock, int fd);
+/* Fetches the fd of the map or function at path, an absolute path under a
+ * mount. A trailing "/fd", for the socket each of them used to have, is
+ * ignored. Returns -1 on error. */
 int bcc_recv_fd(const char *path);
 
+/* Name of the socket at the mount root that hands out fds by path. A
+ * request is a line per path, relative to the mount root, ended by an empty
+ * line. The reply has an int32_t per path, in order: 0 if the fd of that
+ * path comes with it, else a negative errno. The fds come as SCM_RIGHTS
+ * control messages, in the same order, at most 64 to a message. The
+ * connection stays open for more requests, and a client may send several
+ * before reading the replies, which come back in order. */
+#define BCC_CONTROL_SOCKET ".control"
+
+/* Fetches the fds of n paths under the mount at mount in one request, e.g.
+ * "prog/maps/counts" for the fd of a map or "prog/functions/hello" for that
+ * of a loaded function. fds[i] is set to the fd of paths[i], or to a
+ * negative errno if that one failed. Returns 0, or -1 if the request as a
+ * whole failed, in which case no fds are returned. */
+int bcc_recv_fds(const char *mount, const char *const *paths, int *fds, int n);
+
+/* The same in steps, over a connection kept for any number of requests:
+ * bcc_fd_connect() returns the connection to the control socket of the
+ * mount, bcc_fd_request() sends a request for n paths and bcc_fd_reply()
+ * reads the reply to the oldest request not yet read, which must have been
+ * for n paths. All return -1 on error. */
+int bcc_fd_connect(const char *mount);
+int bcc_fd_request(int sock, const char *const *paths, int n);
+int bcc_fd_reply(int sock, int *fds, int n);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,6 +15,7 @@
  */
 
 #include <algorithm>
+#include <cstring>
 #include <fuse.h>
 #include <string>
 #include <bcc/bpf_common.h>
@@ -27,6 +28,7 @@
 
 using std::map;
 using std::move;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 
@@ -36,16 +38,25 @@ Dir::Dir(mode_t mode)
     : Inode(dir_e, mode), n_files_(0), n_dirs_(0) {
 }
 
-Inode * Dir::leaf(Path *path) {
+shared_ptr<Inode> Dir::leaf(Path *path) {
   if (!path->next())
-    return this;
-  auto it = children_.find(path->next());
+    return shared_from_this();
+  shared_ptr<Inode> child = lookup(path->next());
+  if (!child)
+    return shared_from_this();
+  return child->leaf(path->consume());
+}
+
+shared_ptr<Inode> Dir::lookup(const char *name) {
+  ReadLock guard(lock_);
+  auto it = children_.find(name);
   if (it == children_.end())
-    return this;
-  return it->second->leaf(path->consume());
+    return nullptr;
+  return it->second;
 }
 
 int Dir::getattr(struct stat *st) {
+  ReadLock guard(lock_);
   st->st_mode = S_IFDIR | mode_;
   st->st_nlink = 2 + n_dirs_;
   return 0;
@@ -53,6 +64,7 @@ int Dir::getattr(struct stat *st) {
 
 int Dir::readdir(void *buf, fuse_fill_dir_t filler, off_t offset,
                  struct fuse_file_info *fi) {
+  ReadLock guard(lock_);
   filler(buf, ".", nullptr, 0);
   filler(buf, "..", nullptr, 0);
   for (auto it = children_.begin(); it != children_.end(); ++it)
@@ -60,122 +72,233 @@ int Dir::readdir(void *buf, fuse_fill_dir_t filler, off_t offset,
   return 0;
 }
 
+int Dir::readdir_part(void *buf, fuse_fill_dir_t filler, unique_ptr<FileHandle> *cursor) {
+  if (int rc = readdir(buf, filler, 0, nullptr))
+    return rc;
+  return 0;
+}
+
 int Dir::mknod(const char *name, mode_t mode, dev_t rdev) {
   if (S_ISSOCK(mode))
-    add_child(name, make_unique<Socket>(mode, rdev));
+    add_child(name, make_node<Socket>(mode, rdev));
   else
     return -EPERM;
   return 0;
 }
 
 int Dir::unlink(const char *name) {
+  shared_ptr<Inode> node;
+  WriteLock guard(lock_);
   auto it = children_.find(name);
   if (it == children_.end()) return -ENOENT;
   if (it->second->mode() & S_IWUSR) {
-    if (int rc = it->second->unlink()) {
-      remove_child(name);
-      return rc;
-    }
-    remove_child(name);
-    return 0;
+    int rc = it->second->unlink();
+    node = erase_child(name);
+    return rc;
   }
   return -EPERM;
 }
 
-void Dir::add_child(const string &name, unique_ptr<Inode> node) {
-  remove_child(name);
-  if (node->type() == file_e)
-    ++n_files_;
-  else
+void Dir::add_child(const string &name, shared_ptr<Inode> node) {
+  shared_ptr<Inode> old;
+  WriteLock guard(lock_);
+  old = insert_child(name, move(node));
+}
+
+void Dir::remove_child(const string &name) {
+  shared_ptr<Inode> old;
+  WriteLock guard(lock_);
+  old = erase_child(name);
+}
+
+shared_ptr<Inode> Dir::insert_child(const string &name, shared_ptr<Inode> node) {
+  shared_ptr<Inode> old = erase_child(name);
+  if (node->type() == dir_e)
     ++n_dirs_;
-  node->set_parent(this);
+  else
+    ++n_files_;
+  if (!node->parent())
+    node->set_parent(std::static_pointer_cast<Dir>(shared_from_this()));
   children_[name] = move(node);
+  return old;
 }
 
-void Dir::remove_child(const string &name) {
+shared_ptr<Inode> Dir::erase_child(const string &name) {
   auto it = children_.find(name);
-  if (it != children_.end()) {
-    if (it->second->type() == file_e)
-      --n_files_;
-    else
-      --n_dirs_;
-    it->second->set_parent(nullptr);
-    children_.erase(it);
-  }
+  if (it == children_.end())
+    return nullptr;
+  return erase_child(it);
+}
+
+shared_ptr<Inode> Dir::erase_child(Children::iterator it) {
+  if (it->second->type() == dir_e)
+    --n_dirs_;
+  else
+    --n_files_;
+  shared_ptr<Inode> old = move(it->second);
+  children_.erase(it);
+  return old;
 }
 
 string Dir::path(const Inode *node) const {
+  string prefix = Inode::path();
+  ReadLock guard(lock_);
   // TODO: inefficient
   for (auto&& it : children_) {
     if (&*it.second == node)
-      return Inode::path() + "/" + it.first;
+      return prefix + "/" + it.first;
   }
   return "?";
 }
 
 int RootDir::mkdir(const char *path, mode_t mode) {
+  auto node = make_node<ProgramDir>(mode);
+  WriteLock guard(lock_);
   auto it = children_.find(path);
   if (it != children_.end())
     return -EEXIST;
-  add_child(path, make_unique<ProgramDir>(mode));
+  insert_child(path, move(node));
   return 0;
 }
 
 ProgramDir::ProgramDir(mode_t mode)
-    : Dir(mode), bpf_module_(nullptr) {
-  add_child("source", make_unique<SourceFile>());
-  add_child("valid", make_unique<StatFile>("0\n"));
+    : Dir(mode), seq_(0) {
+}
+
+void ProgramDir::init() {
+  add_child("source", make_node<SourceFile>());
+  add_child("valid", make_node<StatFile>("0\n"));
+  add_child("status", make_node<StatusFile>("unloaded\n"));
 }
 
 ProgramDir::~ProgramDir() {
   unload();
 }
 
-int ProgramDir::load(const char *text) {
-  StatFile *validf = dynamic_cast<StatFile *>(&*children_["valid"]);
-  if (!validf) return 1;
-  void *m = bpf_module_create_c_from_string(text, 0);
-  if (!m) {
-    validf->set_data("0\n");
+void ProgramDir::set_state(const char *valid, const char *status, bool pending) {
+  if (auto validf = std::dynamic_pointer_cast<StatFile>(Dir::lookup("valid")))
+    validf->set_data(valid);
+  if (auto statusf = std::dynamic_pointer_cast<StatusFile>(Dir::lookup("status"))) {
+    if (pending)
+      statusf->set_pending(status);
+    else
+      statusf->set_done(status);
+  }
+}
+
+int ProgramDir::load(const string &text) {
+  uint64_t seq = begin_load(text);
+  if (!seq)
+    return 0;
+  if (auto artifact = mount_->modules().find(text, 0))
+    return finish_load(seq, artifact);
+  if (auto artifact = mount_->disk_cache().find(text, 0)) {
+    mount_->modules().insert(artifact);
+    return finish_load(seq, artifact);
+  }
+  std::weak_ptr<ProgramDir> weak = std::static_pointer_cast<ProgramDir>(shared_from_this());
+  Mount *mount = mount_;
+  bool queued = mount_->compiler().submit([weak, seq, text, mount] () {
+    // the compile itself runs without any lock held
+    auto artifact = Artifact::compile(text, 0);
+    if (artifact)
+      mount->modules().insert(artifact);
+    if (auto dir = weak.lock())
+      dir->finish_load(seq, artifact);
+    if (artifact)
+      mount->disk_cache().store(*artifact);
+  });
+  if (queued)
+    return 0;
+  auto artifact = Artifact::compile(text, 0);
+  if (artifact)
+    mount_->modules().insert(artifact);
+  int rc = finish_load(seq, artifact);
+  if (artifact)
+    mount_->disk_cache().store(*artifact);
+  return rc;
+}
+
+// Returns the sequence number of the new load, or 0 if text is what is
+// already loaded (or being loaded), so that rewriting identical source
+// leaves the module and its maps alone.
+uint64_t ProgramDir::begin_load(const string &text) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (text == text_)
+    return 0;
+  // the old module stays in place until the new one is ready
+  text_ = text;
+  set_state("pending\n", "pending\n", true);
+  return ++seq_;
+}
+
+int ProgramDir::finish_load(uint64_t seq, shared_ptr<Artifact> artifact) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (seq != seq_) {
+    // source was rewritten while this compile ran, a newer one is pending
+    return 0;
+  }
+  // The new module is built before the old one goes, so that it can take
+  // over maps from it. Nodes that outlive this load (e.g. an open map
+  // entry) keep the old module alive through their own reference.
+  shared_ptr<Module> module;
+  if (artifact) {
+    const Module *previous = mount_->options().preserve_maps ? module_.get() : nullptr;
+    module = Module::create(artifact, previous);
+  }
+  unload_locked();
+  module_ = module;
+  if (!module_) {
+    text_.clear();
+    set_state("0\n", "failed\n");
     return 1;
   }
-  bpf_module_ = m;
-  validf->set_data("1\n");
 
-  auto functions = make_unique<Dir>(mode_);
-  size_t num_functions = bpf_num_functions(bpf_module_);
-  for (size_t i = 0; i < num_functions; ++i) {
-    functions->add_child(bpf_function_name(bpf_module_, i),
-                         make_unique<FunctionDir>(mode_, bpf_module_, i));
+  auto functions = make_node<Dir>(mode_);
+  for (size_t i = 0; i < module_->num_functions(); ++i) {
+    functions->add_child(module_->function_name(i),
+                         make_node<FunctionDir>(mode_, module_, i));
   }
   add_child("functions", move(functions));
 
-  auto maps = make_unique<Dir>(mode_);
-  size_t num_tables = bpf_num_tables(bpf_module_);
-  for (size_t i = 0; i < num_tables; ++i) {
-    maps->add_child(bpf_table_name(bpf_module_, i),
-                    make_unique<MapDir>(mode_, bpf_module_, i));
+  auto maps = make_node<Dir>(mode_);
+  for (size_t i = 0; i < module_->num_tables(); ++i) {
+    maps->add_child(module_->table_name(i),
+                    make_node<MapDir>(mode_, module_, i));
   }
   add_child("maps", move(maps));
+  set_state("1\n", "loaded\n");
   return 0;
 }
 
 void ProgramDir::unload() {
-  if (StatFile *validf = dynamic_cast<StatFile *>(&*children_["valid"]))
-    validf->set_data("0\n");
-  if (bpf_module_)
-    bpf_module_destroy(bpf_module_);
+  std::lock_guard<std::mutex> guard(mutex_);
+  // a compile still in flight is dropped when it completes
+  ++seq_;
+  text_.clear();
+  unload_locked();
+  set_state("0\n", "unloaded\n");
+}
+
+void ProgramDir::unload_locked() {
   remove_child("functions");
   remove_child("maps");
-  bpf_module_ = nullptr;
+  invalidate("functions");
+  invalidate("maps");
+  module_.reset();
 }
 
-FunctionDir::FunctionDir(mode_t mode, void *bpf_module, int id)
-    : Dir(mode), bpf_module_(bpf_module), id_(id) {
-  add_child("type", make_unique<FunctionTypeFile>());
+FunctionDir::FunctionDir(mode_t mode, shared_ptr<Module> module, int id)
+    : Dir(mode), module_(module), id_(id) {
+}
+
+void FunctionDir::init() {
+  add_child("type", make_node<FunctionTypeFile>());
 }
 
 int FunctionDir::load(const string &type) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  unload_locked();
   bpf_prog_type prog_type = BPF_PROG_TYPE_UNSPEC;
   if (type == "filter")
     prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
@@ -188,93 +311,484 @@ int FunctionDir::load(const string &type) {
   else
     return -1;
   char log_buf[64 * 1024];
-  int fd = bpf_prog_load(prog_type, (const bpf_insn *)bpf_function_start_id(bpf_module_, id_),
-                         bpf_function_size_id(bpf_module_, id_), bpf_module_license(bpf_module_),
-                         bpf_module_kern_version(bpf_module_), log_buf, sizeof(log_buf));
+  int fd = bpf_prog_load(prog_type, module_->function_start(id_),
+                         module_->function_size(id_), module_->license(),
+                         module_->kern_version(), log_buf, sizeof(log_buf));
   if (fd < 0) {
-    add_child("error", make_unique<StatFile>(log_buf));
+    add_child("error", make_node<StatFile>(log_buf));
     return -1;
   }
-  add_child("fd", make_unique<FDSocket>(mode_, 0, fd));
+  prog_fd_ = shared_ptr<const int>(new int(fd), [] (const int *p) {
+    close(*p);
+    delete p;
+  });
   return 0;
 }
 
 void FunctionDir::unload() {
-  remove_child("fd");
+  std::lock_guard<std::mutex> guard(mutex_);
+  unload_locked();
+}
+
+shared_ptr<const int> FunctionDir::prog_fd() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return prog_fd_;
+}
+
+void FunctionDir::unload_locked() {
+  prog_fd_.reset();
   remove_child("error");
+  invalidate("error");
+}
+
+// Position of one listing of a map directory
+struct MapListCursor : public FileHandle {
+  MapListCursor(int fd, size_t key_size, size_t leaf_size, size_t batch_size, bool leaves)
+      : reader(fd, key_size, leaf_size, batch_size, leaves), n(0), i(0) {}
+  MapReader reader;
+  // entries in the current batch, and the next one to list
+  int n;
+  int i;
+};
+
+MapDir::MapDir(mode_t mode, shared_ptr<Module> module, int id)
+    : Dir(mode), module_(module), id_(id), pool_(std::make_shared<SlabPool>()),
+      flush_pending_(false), interval_(0),
+      fixed_interval_(0), sched_gen_(0) {
 }
 
-MapDir::MapDir(mode_t mode, void *bpf_module, int id)
-    : Dir(mode), bpf_module_(bpf_module), id_(id), last_ts_(0) {
-  add_child("fd", make_unique<FDSocket>(mode_, 0, map_fd()));
-  add_child("dump", make_unique<MapDumpFile>(bpf_module_, id_));
+void MapDir::init() {
+  add_child("dump", make_node<MapDumpFile>(module_, id_));
+  add_child("dump.bin", make_node<MapBinaryDumpFile>(module_, id_));
+  add_child("refresh", make_node<MapRefreshFile>());
+  add_child("raw", make_node<MapRawDir>(mode_, module_, id_));
+  set_refresh_interval(0);
 }
 
 int MapDir::map_fd() const {
-  return bpf_table_fd_id(bpf_module_, id_);
+  return module_->table_fd(id_);
 }
 
-int MapDir::getattr(struct stat *st) {
-  if (int rc = refresh())
-    return rc;
-  return Dir::getattr(st);
-}
-
-#define REFRESH_TIME_NSEC (1 * 1e9)
-int MapDir::refresh() {
-  // Once a second, refresh the file list in the directory.
-  // Since the map api is unordered, currently we need to wipe the list of
-  // children and build it from scratch each time. However, objects that have
-  // already been inserted into the map should not be removed, since a client
-  // may have it open(). So, keep the object pointer alive and move it from one
-  // list epoch to the other.
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  uint64_t new_ts = (uint64_t)ts.tv_sec * 1e9 + ts.tv_nsec;
-  if (new_ts < last_ts_ + REFRESH_TIME_NSEC)
-    return 0;
-  last_ts_ = new_ts;
-  auto old_children = move(children_);
-  children_["fd"] = move(old_children["fd"]);
-  children_["dump"] = move(old_children["dump"]);
-  n_dirs_ = 0;
-  n_files_ = 2;
-  int fd = map_fd();
-  size_t key_size = bpf_table_key_size_id(bpf_module_, id_);
-  size_t leaf_size = bpf_table_leaf_size_id(bpf_module_, id_);
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size]);
+shared_ptr<Inode> MapDir::lookup(const char *name) {
+  if (auto node = Dir::lookup(name)) {
+    touch(node.get());
+    return node;
+  }
+  // Entries are only made once looked up. A key is checked with one lookup
+  // (or none, right after a listing), whatever the size of the map, and
+  // gets the name a listing gives it.
+  size_t leaf_size = module_->leaf_size(id_);
+  string key;
+  if (!parse_name(name, &key))
+    return nullptr;
+  string leaf;
+  std::chrono::steady_clock::time_point expires;
+  {
+    std::lock_guard<std::mutex> guard(refresh_mutex_);
+    auto it = prefetched_.find(key);
+    if (it != prefetched_.end() && std::chrono::steady_clock::now() < prefetched_until_) {
+      leaf = it->second;
+      expires = prefetched_until_;
+    }
+  }
+  bool fresh = !leaf.empty();
+  if (!fresh) {
+    leaf.resize(leaf_size);
+    if (bpf_lookup_elem(map_fd(), &key[0], &leaf[0]))
+      return nullptr;
+  }
+  auto node = materialize(key);
+  if (fresh) {
+    if (auto entry = std::dynamic_pointer_cast<MapEntry>(node))
+      entry->prefetched((const uint8_t *)leaf.data(), expires);
+  }
+  return node;
+}
+
+bool MapDir::parse_name(const char *name, string *key) const {
+  size_t key_size = module_->key_size(id_);
+  key->assign(key_size, '\0');
+  if (module_->key_sscanf(id_, name, &(*key)[0]))
+    return false;
+  // "1" and "0x01" would be another name for key 0x1, which unlink and
+  // listings would not know
   unique_ptr<char[]> key_str(new char[key_size * 8]);
-  memset(&key[0], 0, key_size);
-  while (bpf_get_next_key(fd, &key[0], &key[0]) == 0) {
-    if (bpf_table_key_snprintf(bpf_module_, id_, &key_str[0], key_size * 8, &key[0]))
-      return -EIO;
-    auto it = old_children.find(&key_str[0]);
-    unique_ptr<uint8_t[]> k(new uint8_t[key_size]);
-    memcpy(&k[0], &key[0], key_size);
-    if (it == old_children.end())
-      add_child(&key_str[0], make_unique<MapEntry>(move(k), leaf_size));
-    else
-      add_child(&key_str[0], move(it->second));
+  if (module_->key_snprintf(id_, &key_str[0], key_size * 8, key->data()))
+    return false;
+  return strcmp(&key_str[0], name) == 0;
+}
+
+bool MapDir::KeyRef::operator==(const KeyRef &other) const {
+  return size == other.size && !memcmp(data, other.data, size);
+}
+
+size_t MapDir::KeyHash::operator()(const KeyRef &key) const {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < key.size; ++i) {
+    h ^= key.data[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+MapEntry * MapDir::find_locked(const void *key) const {
+  auto it = index_.find(KeyRef{(const uint8_t *)key, module_->key_size(id_)});
+  return it != index_.end() ? it->second : nullptr;
+}
+
+void MapDir::touch(Inode *node) {
+  auto entry = dynamic_cast<MapEntry *>(node);
+  if (!entry)
+    return;
+  std::lock_guard<std::mutex> guard(refresh_mutex_);
+  // it may have been dropped since it was found
+  if (find_locked(entry->key_data()) == entry)
+    lru_.splice(lru_.begin(), lru_, entry->lru_);
+}
+
+shared_ptr<Inode> MapDir::materialize(const string &key) {
+  std::lock_guard<std::mutex> refresh_guard(refresh_mutex_);
+  if (MapEntry *entry = find_locked(key.data())) {
+    lru_.splice(lru_.begin(), lru_, entry->lru_);
+    return entry->shared_from_this();
+  }
+  size_t key_size = module_->key_size(id_);
+  unique_ptr<char[]> key_str(new char[key_size * 8]);
+  if (module_->key_snprintf(id_, &key_str[0], key_size * 8, key.data()))
+    return nullptr;
+  auto entry = allocate_node<MapEntry>(SlabAllocator<MapEntry>(pool_), module_, id_, key.data());
+  insert_locked(&key_str[0], entry);
+  return entry;
+}
+
+void MapDir::insert_locked(const string &name, shared_ptr<MapEntry> entry) {
+  // name is that of no other entry, as names follow from keys
+  MapEntry *e = entry.get();
+  shared_ptr<Inode> old;
+  {
+    WriteLock guard(lock_);
+    old = insert_child(name, move(entry));
+    e->child_ = children_.find(name);
+  }
+  lru_.push_front(e);
+  e->lru_ = lru_.begin();
+  index_[KeyRef{e->key_data(), e->key_size()}] = e;
+  evict_locked();
+}
+
+void MapDir::erase_locked(MapEntry *entry, std::vector<shared_ptr<Inode>> *removed) {
+  index_.erase(KeyRef{entry->key_data(), entry->key_size()});
+  lru_.erase(entry->lru_);
+  WriteLock guard(lock_);
+  removed->push_back(erase_child(entry->child_));
+}
+
+void MapDir::evict_locked() {
+  // Least recently used first, but entries that are open stay, so that
+  // their handles keep working on the node the directory has.
+  size_t budget = mount_->options().map_entries;
+  for (size_t tries = index_.size(); index_.size() > budget && tries; --tries) {
+    MapEntry *entry = lru_.back();
+    if (entry->pinned()) {
+      lru_.splice(lru_.begin(), lru_, entry->lru_);
+      continue;
+    }
+    string name = entry->child_->first;
+    std::vector<shared_ptr<Inode>> removed;
+    erase_locked(entry, &removed);
+    // The kernel may still have the name cached, and it can not be told so
+    // from within a request on this directory. Keep the node answering
+    // until the refresher thread has invalidated the name.
+    evicted_.emplace_back(move(name), move(removed.back()));
+  }
+  if (!evicted_.empty() && !flush_pending_) {
+    flush_pending_ = true;
+    mount_->refresher().flush(std::static_pointer_cast<MapDir>(shared_from_this()));
+  }
+}
+
+void MapDir::flush_evicted() {
+  std::vector<std::pair<string, shared_ptr<Inode>>> evicted;
+  {
+    std::lock_guard<std::mutex> guard(refresh_mutex_);
+    evicted.swap(evicted_);
+    flush_pending_ = false;
+  }
+  for (auto &e : evicted)
+    invalidate(e.first);
+}
+
+double MapDir::scheduled_refresh(uint64_t gen) {
+  {
+    std::lock_guard<std::mutex> guard(refresh_mutex_);
+    if (gen != sched_gen_)
+      return -1;
+  }
+  size_t churn = 0;
+  if (int rc = refresh(&churn))
+    mount_->log("refresh %s: %s\n", Inode::path().c_str(), strerror(-rc));
+  std::lock_guard<std::mutex> guard(refresh_mutex_);
+  if (gen != sched_gen_)
+    return -1;
+  if (fixed_interval_ > 0)
+    return fixed_interval_;
+  // Look again sooner while the map is changing, and back off while it is
+  // not, within the bounds given at mount time.
+  const MountOptions &opts = mount_->options();
+  interval_ = churn ? interval_ / 2 : interval_ * 2;
+  interval_ = std::min(std::max(interval_, opts.refresh_min), opts.refresh_max);
+  return interval_;
+}
+
+void MapDir::set_refresh_interval(double seconds) {
+  double delay;
+  uint64_t gen;
+  {
+    std::lock_guard<std::mutex> guard(refresh_mutex_);
+    fixed_interval_ = seconds;
+    interval_ = seconds > 0 ? seconds : mount_->options().refresh_min;
+    delay = interval_;
+    // the refresh already queued is dropped when it comes up
+    gen = ++sched_gen_;
+  }
+  mount_->refresher().schedule(std::static_pointer_cast<MapDir>(shared_from_this()),
+                               delay, gen);
+}
+
+double MapDir::refresh_interval() {
+  std::lock_guard<std::mutex> guard(refresh_mutex_);
+  return fixed_interval_;
+}
+
+int MapDir::refresh(size_t *churn) {
+  // Drop the entries whose key has left the map, except those still open.
+  // Only entries that were looked up are resident, so this costs a lookup
+  // for each of those rather than a walk of the map.
+  std::vector<shared_ptr<MapEntry>> resident;
+  {
+    std::lock_guard<std::mutex> guard(refresh_mutex_);
+    for (auto &it : index_)
+      resident.push_back(std::static_pointer_cast<MapEntry>(it.second->shared_from_this()));
+  }
+  unique_ptr<uint8_t[]> leaf(new uint8_t[module_->leaf_size(id_)]);
+  std::vector<MapEntry *> gone;
+  for (auto &entry : resident) {
+    if (bpf_lookup_elem(map_fd(), entry->key_data(), &leaf[0]) && errno == ENOENT)
+      gone.push_back(entry.get());
   }
+  std::vector<string> names;
+  // released after the lock is dropped
+  std::vector<shared_ptr<Inode>> removed;
+  {
+    std::lock_guard<std::mutex> guard(refresh_mutex_);
+    for (MapEntry *entry : gone) {
+      if (find_locked(entry->key_data()) != entry || entry->pinned())
+        continue;
+      names.push_back(entry->child_->first);
+      erase_locked(entry, &removed);
+    }
+  }
+  *churn = names.size();
+  // not in a request, so the kernel can be told right away
+  for (auto &name : names)
+    invalidate(name);
   return 0;
 }
 
-int MapDir::readdir(void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-  if (int rc = refresh())
-    return rc;
-  return Dir::readdir(buf, filler, offset, fi);
+int MapDir::readdir_part(void *buf, fuse_fill_dir_t filler, unique_ptr<FileHandle> *cursor) {
+  // Names come straight from the walk of the map, without entries being
+  // made for them, so listing a large map takes no more memory than a batch.
+  bool leaves = mount_->options().value_ttl > 0;
+  size_t key_size = module_->key_size(id_);
+  if (!*cursor) {
+    filler(buf, ".", nullptr, 0);
+    filler(buf, "..", nullptr, 0);
+    {
+      ReadLock guard(lock_);
+      for (auto &it : children_) {
+        if (!dynamic_cast<MapEntry *>(it.second.get()))
+          filler(buf, it.first.c_str(), nullptr, 0);
+      }
+    }
+    cursor->reset(new MapListCursor(map_fd(), key_size, module_->leaf_size(id_),
+                                    mount_->options().batch_size, leaves));
+  }
+  auto c = static_cast<MapListCursor *>(cursor->get());
+  unique_ptr<char[]> key_str(new char[key_size * 8]);
+  for (;;) {
+    if (c->i == c->n) {
+      c->n = c->reader.next();
+      c->i = 0;
+      if (c->n <= 0)
+        return c->n;
+      if (leaves)
+        prefetch(c->reader, c->n);
+    }
+    if (module_->key_snprintf(id_, &key_str[0], key_size * 8, c->reader.key(c->i++)))
+      return -EIO;
+    if (filler(buf, &key_str[0], nullptr, 0))
+      return 1;
+  }
+}
+
+void MapDir::prefetch(const MapReader &reader, int n) {
+  // A listing is usually followed by a lookup and a getattr for every name
+  // in it (ls -l). Keep the values that came along with the keys for a
+  // while, as many as there may be entries, so that those do not each look
+  // the key up again.
+  size_t key_size = module_->key_size(id_);
+  size_t leaf_size = module_->leaf_size(id_);
+  size_t budget = mount_->options().map_entries;
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point expires;
+  std::vector<shared_ptr<MapEntry>> entries(n);
+  {
+    std::lock_guard<std::mutex> guard(refresh_mutex_);
+    if (now >= prefetched_until_) {
+      prefetched_.clear();
+      prefetched_until_ = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(mount_->options().value_ttl));
+    }
+    expires = prefetched_until_;
+    for (int i = 0; i < n; ++i) {
+      // entries that are resident get theirs right away
+      if (MapEntry *entry = find_locked(reader.key(i)))
+        entries[i] = std::static_pointer_cast<MapEntry>(entry->shared_from_this());
+      else if (prefetched_.size() < budget)
+        prefetched_[string((const char *)reader.key(i), key_size)] =
+            string((const char *)reader.leaf(i), leaf_size);
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    if (entries[i])
+      entries[i]->prefetched(reader.leaf(i), expires);
+  }
 }
 
 int MapDir::create(const char *name, mode_t mode, struct fuse_file_info *fi) {
-  size_t key_size = bpf_table_key_size_id(bpf_module_, id_);
-  size_t leaf_size = bpf_table_leaf_size_id(bpf_module_, id_);
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size]);
-  if (bpf_table_key_sscanf(bpf_module_, id_, name, &key[0]))
+  string raw;
+  if (!parse_name(name, &raw))
     return -EIO;
-  auto ent = make_unique<MapEntry>(move(key), leaf_size);
-  fi->fh = (uintptr_t) &*ent;
-  add_child(name, move(ent));
+  auto entry = allocate_node<MapEntry>(SlabAllocator<MapEntry>(pool_), module_, id_, raw.data());
+  std::vector<shared_ptr<Inode>> removed;
+  std::lock_guard<std::mutex> refresh_guard(refresh_mutex_);
+  // made meanwhile by a lookup
+  if (MapEntry *old = find_locked(raw.data()))
+    erase_locked(old, &removed);
+  // until it is written, a refresh after it is closed drops it again
+  insert_locked(name, move(entry));
   return 0;
 }
 
+int MapDir::unlink(const char *name) {
+  // released after the lock is dropped
+  std::vector<shared_ptr<Inode>> removed;
+  std::lock_guard<std::mutex> guard(refresh_mutex_);
+  auto entry = std::dynamic_pointer_cast<MapEntry>(Dir::lookup(name));
+  if (!entry || find_locked(entry->key_data()) != entry.get())
+    return Dir::unlink(name);
+  if (!(entry->mode() & S_IWUSR))
+    return -EPERM;
+  int rc = entry->unlink();
+  erase_locked(entry.get(), &removed);
+  return rc;
+}
+
+MapRawDir::MapRawDir(mode_t mode, shared_ptr<Module> module, int id)
+    : Dir(mode), module_(module), id_(id), flush_pending_(false) {
+}
+
+shared_ptr<Inode> MapRawDir::lookup(const char *name) {
+  size_t key_size = module_->key_size(id_);
+  string key(key_size, '\0');
+  if (strlen(name) != 2 * key_size || !hex_decode(name, key_size, (uint8_t *)&key[0]))
+    return nullptr;
+  unique_ptr<uint8_t[]> leaf(new uint8_t[module_->leaf_size(id_)]);
+  bool gone = bpf_lookup_elem(module_->table_fd(id_), &key[0], &leaf[0]) != 0;
+  shared_ptr<Inode> node;
+  std::lock_guard<std::mutex> guard(lru_mutex_);
+  if (gone) {
+    // the key is gone, and with it any node made for it
+    {
+      WriteLock lock(lock_);
+      node = erase_child(name);
+    }
+    if (node)
+      lru_.erase(static_cast<MapRawEntry *>(node.get())->lru_);
+    return nullptr;
+  }
+  if ((node = Dir::lookup(name))) {
+    auto entry = static_cast<MapRawEntry *>(node.get());
+    lru_.splice(lru_.begin(), lru_, entry->lru_);
+    return node;
+  }
+  auto entry = make_node<MapRawEntry>(module_, id_, key);
+  lru_.push_front(entry.get());
+  entry->lru_ = lru_.begin();
+  {
+    WriteLock lock(lock_);
+    insert_child(name, entry);
+  }
+  evict_locked();
+  return entry;
+}
+
+void MapRawDir::evict_locked() {
+  // Open handles hold on to their node, so unlike MapDir none need stay.
+  size_t key_size = module_->key_size(id_);
+  size_t budget = mount_->options().map_entries;
+  while (lru_.size() > budget) {
+    MapRawEntry *entry = lru_.back();
+    lru_.pop_back();
+    string name(2 * key_size, '\0');
+    hex_encode((const uint8_t *)entry->key_.data(), key_size, &name[0]);
+    shared_ptr<Inode> node;
+    {
+      WriteLock lock(lock_);
+      node = erase_child(name);
+    }
+    // answers until its name is invalidated, as in MapDir
+    evicted_.emplace_back(move(name), move(node));
+  }
+  if (!evicted_.empty() && !flush_pending_) {
+    flush_pending_ = true;
+    mount_->refresher().flush(std::static_pointer_cast<Dir>(shared_from_this()));
+  }
+}
+
+void MapRawDir::flush_evicted() {
+  std::vector<std::pair<string, shared_ptr<Inode>>> evicted;
+  {
+    std::lock_guard<std::mutex> guard(lru_mutex_);
+    evicted.swap(evicted_);
+    flush_pending_ = false;
+  }
+  for (auto &e : evicted)
+    invalidate(e.first);
+}
+
+int MapRawDir::readdir_part(void *buf, fuse_fill_dir_t filler, unique_ptr<FileHandle> *cursor) {
+  size_t key_size = module_->key_size(id_);
+  if (!*cursor) {
+    filler(buf, ".", nullptr, 0);
+    filler(buf, "..", nullptr, 0);
+    cursor->reset(new MapListCursor(module_->table_fd(id_), key_size, module_->leaf_size(id_),
+                                    mount_->options().batch_size, false));
+  }
+  auto c = static_cast<MapListCursor *>(cursor->get());
+  string name(2 * key_size, '\0');
+  for (;;) {
+    if (c->i == c->n) {
+      c->n = c->reader.next();
+      c->i = 0;
+      if (c->n <= 0)
+        return c->n;
+    }
+    hex_encode(c->reader.key(c->i++), key_size, &name[0]);
+    if (filler(buf, name.c_str(), nullptr, 0))
+      return 1;
+  }
+}
+
 }  // namespace bcc
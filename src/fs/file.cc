@@ -14,24 +14,34 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <bcc/libbpf.h>
+#include <fcntl.h>
 #include <fuse.h>
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <poll.h>
 #include <string>
-#include <sstream>
 #include <unistd.h>
 
 #include <bcc/bpf_common.h>
 
+#include "client.h"
 #include "mount.h"
 #include "string_util.h"
 
+using std::chrono::steady_clock;
+using std::function;
+using std::lock_guard;
 using std::move;
+using std::mutex;
+using std::shared_ptr;
 using std::string;
-using std::stringstream;
 using std::unique_ptr;
+using std::vector;
 
 namespace bcc {
 
@@ -43,10 +53,14 @@ int File::getattr(struct stat *st) {
 }
 
 int File::open(struct fuse_file_info *fi) {
-  fi->fh = (uintptr_t)this;
+  fi->fh = 0;
   return 0;
 }
 
+unsigned File::poll(function<void()> notify) {
+  return POLLIN | POLLOUT;
+}
+
 int File::read_helper(const string &data, char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)  {
   if (offset < (off_t)data.size()) {
@@ -59,7 +73,13 @@ int File::read_helper(const string &data, char *buf, size_t size,
   return size;
 }
 
+size_t StringFile::size() const {
+  lock_guard<mutex> guard(mutex_);
+  return data_.size();
+}
+
 int StringFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  lock_guard<mutex> guard(mutex_);
   if (offset < (off_t)data_.size()) {
     if (offset + size > data_.size())
       size = data_.size() - offset;
@@ -71,6 +91,7 @@ int StringFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info
 }
 
 int StringFile::write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  lock_guard<mutex> guard(mutex_);
   if (offset > (off_t)data_.size())
     offset = data_.size();
   data_.replace(offset, size, buf, size);
@@ -78,94 +99,442 @@ int StringFile::write(const char *buf, size_t size, off_t offset, struct fuse_fi
 }
 
 int SourceFile::write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  int rc = StringFile::write(buf, size, offset, fi);
+  lock_guard<mutex> guard(mutex_);
   dirty_ = true;
-  return StringFile::write(buf, size, offset, fi);
+  return rc;
 }
 
 int SourceFile::truncate(off_t newsize) {
+  // whether the program is reloaded is up to flush()
+  lock_guard<mutex> guard(mutex_);
   dirty_ = true;
-  if (ProgramDir *parent = dynamic_cast<ProgramDir *>(parent_))
-    parent->unload();
   data_.resize(newsize);
   return 0;
 }
 
 int SourceFile::flush(struct fuse_file_info *fi) {
-  if (!dirty_)
-    return 0;
-  dirty_ = false;
-  if (data_.empty() || data_ == "\n")
+  string text;
+  {
+    // compile from a copy, so that readers of source are not held up
+    lock_guard<mutex> guard(mutex_);
+    if (!dirty_)
+      return 0;
+    dirty_ = false;
+    text = data_;
+  }
+  auto parent = std::dynamic_pointer_cast<ProgramDir>(parent_.lock());
+  if (!parent)
     return 0;
-  if (ProgramDir *parent = dynamic_cast<ProgramDir *>(parent_)) {
+  if (text.empty() || text == "\n")
     parent->unload();
-    if (parent->load(data_.c_str()))
-      return -EIO;
-  }
+  else if (parent->load(text))
+    return -EIO;
   return 0;
 }
 
+int StatFile::open(struct fuse_file_info *fi) {
+  // contents change underneath the kernel's cached size
+  fi->direct_io = 1;
+  return File::open(fi);
+}
+
 int StatFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  lock_guard<mutex> guard(mutex_);
   return read_helper(data_, buf, size, offset, fi);
 }
 
+size_t StatFile::size() const {
+  lock_guard<mutex> guard(mutex_);
+  return data_.size();
+}
+
+void StatFile::set_data(const string data) {
+  {
+    lock_guard<mutex> guard(mutex_);
+    data_ = data;
+  }
+  mount_->invalidate_inode(this);
+}
+
+StatusFile::~StatusFile() {
+  pending_ = false;
+  wake();
+}
+
+bool StatusFile::pending() const {
+  lock_guard<mutex> guard(mutex_);
+  return pending_;
+}
+
+unsigned StatusFile::poll(function<void()> notify) {
+  lock_guard<mutex> guard(mutex_);
+  if (!pending_)
+    return POLLIN;
+  if (notify)
+    pollers_.push_back(move(notify));
+  return 0;
+}
+
+void StatusFile::wait(function<void(const string &)> fn) {
+  string data;
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (pending_) {
+      waiters_.push_back(move(fn));
+      return;
+    }
+    data = data_;
+  }
+  fn(data);
+}
+
+void StatusFile::set_pending(const string &data) {
+  {
+    lock_guard<mutex> guard(mutex_);
+    pending_ = true;
+    data_ = data;
+  }
+  mount_->invalidate_inode(this);
+}
+
+void StatusFile::set_done(const string &data) {
+  {
+    lock_guard<mutex> guard(mutex_);
+    pending_ = false;
+    data_ = data;
+  }
+  mount_->invalidate_inode(this);
+  wake();
+}
+
+void StatusFile::wake() {
+  std::vector<function<void()>> pollers;
+  std::vector<function<void(const string &)>> waiters;
+  string data;
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (pending_)
+      return;
+    pollers.swap(pollers_);
+    waiters.swap(waiters_);
+    data = data_;
+  }
+  for (auto &fn : pollers)
+    fn();
+  for (auto &fn : waiters)
+    fn(data);
+}
+
+int InfoFile::open(struct fuse_file_info *fi) {
+  string data = fn_();
+  {
+    lock_guard<mutex> guard(mutex_);
+    data_ = move(data);
+  }
+  fi->direct_io = 1;
+  return File::open(fi);
+}
+
+int InfoFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  lock_guard<mutex> guard(mutex_);
+  return read_helper(data_, buf, size, offset, fi);
+}
+
+size_t InfoFile::size() const {
+  lock_guard<mutex> guard(mutex_);
+  return data_.size();
+}
+
 int FunctionTypeFile::truncate(off_t newsize) {
-  if (FunctionDir *parent = dynamic_cast<FunctionDir *>(parent_))
+  if (auto parent = std::dynamic_pointer_cast<FunctionDir>(parent_.lock()))
     parent->unload();
+  lock_guard<mutex> guard(mutex_);
   data_.resize(newsize);
   return 0;
 }
 
 int FunctionTypeFile::flush(struct fuse_file_info *fi) {
-  if (data_.empty() || data_ == "\n")
-    return 0;
-  if (FunctionDir *parent = dynamic_cast<FunctionDir *>(parent_)) {
-    parent->unload();
-    if (parent->load(data_))
+  string type;
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (data_.empty() || data_ == "\n")
+      return 0;
+    type = data_;
+  }
+  if (auto parent = std::dynamic_pointer_cast<FunctionDir>(parent_.lock())) {
+    if (parent->load(type))
       return -EIO;
   }
   return 0;
 }
 
-MapDumpFile::MapDumpFile(void *bpf_module, int id)
-    : File(), bpf_module_(bpf_module), id_(id),
-    fd_(bpf_table_fd_id(bpf_module_, id_)),
-    key_size_(bpf_table_key_size_id(bpf_module_, id_)),
-    leaf_size_(bpf_table_leaf_size_id(bpf_module_, id_)) {
+int MapRefreshFile::open(struct fuse_file_info *fi) {
+  auto parent = std::dynamic_pointer_cast<MapDir>(parent_.lock());
+  if (!parent)
+    return -ENOENT;
+  double interval = parent->refresh_interval();
+  char buf[32];
+  if (interval > 0)
+    snprintf(buf, sizeof(buf), "%g\n", interval);
+  else
+    snprintf(buf, sizeof(buf), "auto\n");
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (!dirty_)
+      data_ = buf;
+  }
+  fi->direct_io = 1;
+  return File::open(fi);
+}
+
+int MapRefreshFile::write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  int rc = StringFile::write(buf, size, offset, fi);
+  lock_guard<mutex> guard(mutex_);
+  dirty_ = true;
+  return rc;
+}
+
+int MapRefreshFile::truncate(off_t newsize) {
+  lock_guard<mutex> guard(mutex_);
+  dirty_ = true;
+  data_.resize(newsize);
+  return 0;
+}
+
+int MapRefreshFile::flush(struct fuse_file_info *fi) {
+  string text;
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (!dirty_)
+      return 0;
+    dirty_ = false;
+    text = data_;
+  }
+  while (!text.empty() && isspace(text.back()))
+    text.pop_back();
+  if (text.empty())
+    return 0;
+  double interval = 0;
+  if (text != "auto") {
+    char *end;
+    interval = strtod(text.c_str(), &end);
+    if (*end || !(interval > 0) || interval > 86400)
+      return -EINVAL;
+  }
+  if (auto parent = std::dynamic_pointer_cast<MapDir>(parent_.lock()))
+    parent->set_refresh_interval(interval);
+  return 0;
+}
+
+struct DumpCursor : public FileHandle {
+  struct Checkpoint {
+    off_t offset;
+    string key;
+  };
+  // reads of one handle may come from several threads
+  std::mutex mutex;
+  unique_ptr<MapReader> reader;
+  int batch_n;
+  int batch_i;
+  // the rendered entry being returned, when it did not fit a read
+  string line;
+  size_t line_pos;
+  // offset in the dump of the next byte to return
+  off_t pos;
+  bool eof;
+  // key of the last entry rendered
+  string key;
+  vector<Checkpoint> checkpoints;
+};
+
+// how far apart the restart points of a dump are
+static const off_t dump_checkpoint_interval = 64 * 1024;
+
+MapDumpFile::MapDumpFile(shared_ptr<Module> module, int id)
+    : File(), module_(module), id_(id), fd_(module_->table_fd(id_)),
+    key_size_(module_->key_size(id_)), leaf_size_(module_->leaf_size(id_)), last_size_(0) {
+}
+
+int MapDumpFile::open(struct fuse_file_info *fi) {
+  unique_ptr<DumpCursor> c(new DumpCursor);
+  c->checkpoints.push_back(DumpCursor::Checkpoint{0, string()});
+  rewind(&*c, 0);
+  // the size the kernel has cached is that of an older dump, if any
+  fi->direct_io = 1;
+  fi->fh = (uintptr_t)static_cast<FileHandle *>(c.release());
+  return 0;
 }
 
 size_t MapDumpFile::size() const {
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size_]);
-  memset(&key[0], 0, key_size_);
-  size_t size = 0;
-  while (bpf_get_next_key(fd_, &key[0], &key[0]) == 0) {
-    size += leaf_size_ * 2 + key_size_ * 2 + 2;
+  return last_size_;
+}
+
+void MapDumpFile::rewind(DumpCursor *c, off_t offset) {
+  auto cp = c->checkpoints.begin();
+  for (auto it = c->checkpoints.begin(); it != c->checkpoints.end() && it->offset <= offset; ++it)
+    cp = it;
+  c->reader.reset(new MapReader(fd_, key_size_, leaf_size_, mount_->options().batch_size));
+  if (!cp->key.empty())
+    c->reader->seek((const uint8_t *)cp->key.data());
+  c->key = cp->key;
+  c->batch_n = c->batch_i = 0;
+  c->line.clear();
+  c->line_pos = 0;
+  c->pos = cp->offset;
+  c->eof = false;
+}
+
+// Renders the next entries into buf, or only moves the cursor if buf is
+// null. Returns the number of bytes, 0 at the end of the map.
+int MapDumpFile::render(DumpCursor *c, char *buf, size_t size) {
+  size_t key_len = key_size_ * 8, leaf_len = leaf_size_ * 8;
+  size_t done = 0;
+  while (done < size) {
+    if (c->line_pos < c->line.size()) {
+      size_t n = std::min(size - done, c->line.size() - c->line_pos);
+      if (buf)
+        memcpy(buf + done, &c->line[c->line_pos], n);
+      c->line_pos += n;
+      c->pos += n;
+      done += n;
+      continue;
+    }
+    if (c->eof)
+      break;
+    if (c->batch_i == c->batch_n) {
+      int n = c->reader->next();
+      if (n < 0)
+        return n;
+      if (n == 0) {
+        c->eof = true;
+        last_size_ = c->pos;
+        break;
+      }
+      c->batch_n = n;
+      c->batch_i = 0;
+    }
+    // between two entries, the place to remember for going back
+    if (c->pos >= c->checkpoints.back().offset + dump_checkpoint_interval)
+      c->checkpoints.push_back(DumpCursor::Checkpoint{c->pos, c->key});
+    const uint8_t *key = c->reader->key(c->batch_i);
+    const uint8_t *leaf = c->reader->leaf(c->batch_i);
+    ++c->batch_i;
+    c->key.assign((const char *)key, key_size_);
+
+    // format in place when even the longest entry fits, else go through line
+    bool direct = buf && size - done >= key_len + leaf_len + 2;
+    char *out;
+    if (direct) {
+      out = buf + done;
+    } else {
+      c->line.resize(key_len + leaf_len + 2);
+      c->line_pos = 0;
+      out = &c->line[0];
+    }
+    if (module_->key_snprintf(id_, out, key_len, key))
+      return -EIO;
+    size_t n = strlen(out);
+    out[n++] = ' ';
+    if (module_->leaf_snprintf(id_, out + n, leaf_len, leaf))
+      return -EIO;
+    n += strlen(out + n);
+    out[n++] = '\n';
+    if (direct) {
+      c->pos += n;
+      done += n;
+    } else {
+      c->line.resize(n);
+    }
   }
-  log("MapDumpFile::size %zu\n", size);
-  return 4096;
+  return done;
 }
 
 int MapDumpFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size_]);
-  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size_]);
-  unique_ptr<char[]> key_str(new char[key_size_ * 8]);
-  unique_ptr<char[]> leaf_str(new char[leaf_size_ * 8]);
-  memset(&key[0], 0, key_size_);
-  stringstream ss;
-  while (bpf_get_next_key(fd_, &key[0], &key[0]) == 0) {
-    if (bpf_lookup_elem(fd_, &key[0], &leaf[0]) == 0) {
-      if (bpf_table_key_snprintf(bpf_module_, id_, &key_str[0], key_size_ * 8, &key[0]))
-        return -EIO;
-      if (bpf_table_leaf_snprintf(bpf_module_, id_, &leaf_str[0], leaf_size_ * 8, &leaf[0]))
-        return -EIO;
-      ss << &key_str[0] << " " << &leaf_str[0] << "\n";
+  auto c = dynamic_cast<DumpCursor *>((FileHandle *)fi->fh);
+  if (!c)
+    return -EBADF;
+  lock_guard<mutex> guard(c->mutex);
+  if (offset < c->pos)
+    rewind(c, offset);
+  while (c->pos < offset) {
+    int rc = render(c, nullptr, offset - c->pos);
+    if (rc <= 0)
+      return rc;
+  }
+  return render(c, buf, size);
+}
+
+namespace {
+struct BinarySnapshot : public FileHandle {
+  string data;
+};
+}  // namespace
+
+MapBinaryDumpFile::MapBinaryDumpFile(shared_ptr<Module> module, int id)
+    : File(), module_(module), id_(id), last_size_(0) {
+}
+
+int MapBinaryDumpFile::open(struct fuse_file_info *fi) {
+  size_t key_size = module_->key_size(id_);
+  size_t leaf_size = module_->leaf_size(id_);
+  string key_desc = module_->key_desc(id_);
+  string leaf_desc = module_->leaf_desc(id_);
+
+  struct bcc_dump_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BCC_DUMP_MAGIC, sizeof(hdr.magic));
+  hdr.header_size = (sizeof(hdr) + key_desc.size() + leaf_desc.size() + 7) & ~7;
+  hdr.key_size = key_size;
+  hdr.leaf_size = leaf_size;
+  hdr.key_desc_len = key_desc.size();
+  hdr.leaf_desc_len = leaf_desc.size();
+
+  unique_ptr<BinarySnapshot> snap(new BinarySnapshot);
+  string &data = snap->data;
+  data.resize(hdr.header_size);
+  MapReader reader(module_->table_fd(id_), key_size, leaf_size, mount_->options().batch_size);
+  int n;
+  while ((n = reader.next()) > 0) {
+    for (int i = 0; i < n; ++i) {
+      data.append((const char *)reader.key(i), key_size);
+      data.append((const char *)reader.leaf(i), leaf_size);
     }
+    hdr.count += n;
   }
-  return read_helper(ss.str(), buf, size, offset, fi);
+  if (n < 0)
+    return n;
+  memcpy(&data[0], &hdr, sizeof(hdr));
+  memcpy(&data[sizeof(hdr)], key_desc.data(), key_desc.size());
+  memcpy(&data[sizeof(hdr) + key_desc.size()], leaf_desc.data(), leaf_desc.size());
+  last_size_ = data.size();
+  fi->direct_io = 1;
+  fi->fh = (uintptr_t)static_cast<FileHandle *>(snap.release());
+  return 0;
+}
+
+size_t MapBinaryDumpFile::size() const {
+  return last_size_;
 }
 
-MapEntry::MapEntry(unique_ptr<uint8_t[]> key, size_t leaf_size)
-    : StringFile(), key_(move(key)), leaf_size_(leaf_size), dirty_(false) {
-  refresh();
+int MapBinaryDumpFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  auto snap = dynamic_cast<BinarySnapshot *>((FileHandle *)fi->fh);
+  if (!snap)
+    return -EBADF;
+  return read_helper(snap->data, buf, size, offset, fi);
+}
+
+MapEntry::MapEntry(shared_ptr<Module> module, int id, const void *key)
+    : StringFile(), module_(module), id_(id), dirty_(false), raw_(false), pins_(0),
+      writers_(0) {
+  if (key_size() > inline_key)
+    key_heap_ = new uint8_t[key_size()];
+  memcpy(key_data(), key, key_size());
+}
+
+MapEntry::~MapEntry() {
+  if (key_size() > inline_key)
+    delete[] key_heap_;
 }
 
 int MapEntry::getattr(struct stat *st) {
@@ -175,10 +544,16 @@ int MapEntry::getattr(struct stat *st) {
 }
 
 int MapEntry::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  lock_guard<mutex> guard(mutex_);
+  if (int rc = format_locked())
+    return rc;
   return read_helper(data_, buf, size, offset, fi);
 }
 
 int MapEntry::truncate(off_t newsize) {
+  lock_guard<mutex> guard(mutex_);
+  if (int rc = format_locked())
+    return rc;
   if (data_.size() != (size_t)newsize)
     dirty_ = true;
   data_.resize(newsize);
@@ -186,55 +561,140 @@ int MapEntry::truncate(off_t newsize) {
 }
 
 int MapEntry::flush(struct fuse_file_info *fi) {
-  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size_]);
-  MapDir *md = dynamic_cast<MapDir *>(parent_);
-  if (!md) return -EBADF;
+  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size()]);
 
+  lock_guard<mutex> guard(mutex_);
   if (!dirty_)
     return 0;
+  if (int rc = format_locked())
+    return rc;
   if (data_.empty() || data_ == "\n")
     return 0;
-  int fd = md->map_fd();
-  if (bpf_table_leaf_sscanf(md->mod(), md->map_id(), data_.c_str(), &leaf[0]))
+  if (module_->leaf_sscanf(id_, data_.c_str(), &leaf[0]))
     return -EIO;
-  if (bpf_update_elem(fd, &key_[0], &leaf[0], 0))
+  if (bpf_update_elem(module_->table_fd(id_), key_data(), &leaf[0], 0))
     return -EIO;
+  dirty_ = false;
+  // a value fetched before this write is out of date
+  fresh_until_ = steady_clock::time_point();
   return 0;
 }
 
 int MapEntry::unlink() {
-  MapDir *md = dynamic_cast<MapDir *>(parent_);
-  if (!md) return -EBADF;
-
-  if (bpf_delete_elem(md->map_fd(), &key_[0]))
+  if (bpf_delete_elem(module_->table_fd(id_), key_data()))
     return -ENOENT;
   return 0;
 }
 
 int MapEntry::write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  // formatted and written in one go, so a prefetch cannot come in between
+  lock_guard<mutex> guard(mutex_);
+  if (int rc = format_locked())
+    return rc;
+  if (offset > (off_t)data_.size())
+    offset = data_.size();
+  data_.replace(offset, size, buf, size);
   dirty_ = true;
-  return StringFile::write(buf, size, offset, fi);
+  return size;
+}
+
+void MapEntry::prefetched(const uint8_t *leaf, steady_clock::time_point expires) {
+  lock_guard<mutex> guard(mutex_);
+  if (writing_locked())
+    return;
+  data_.assign((const char *)leaf, leaf_size());
+  raw_ = true;
+  fresh_until_ = expires;
+}
+
+int MapEntry::format_locked() {
+  if (!raw_)
+    return 0;
+  unique_ptr<char[]> leaf_str(new char[leaf_size() * 8]);
+  if (module_->leaf_snprintf(id_, &leaf_str[0], leaf_size() * 8, data_.data()))
+    return -EIO;
+  data_.assign(&leaf_str[0]);
+  data_ += '\n';
+  raw_ = false;
+  return 0;
 }
 
 int MapEntry::refresh() {
-  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size_]);
-  unique_ptr<char[]> leaf_str(new char[leaf_size_ * 8]);
-  MapDir *md = dynamic_cast<MapDir *>(parent_);
-  if (!md) return -EBADF;
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (steady_clock::now() < fresh_until_)
+      return format_locked();
+  }
+  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size()]);
+  unique_ptr<char[]> leaf_str(new char[leaf_size() * 8]);
 
-  int fd = md->map_fd();
-  if (bpf_lookup_elem(fd, &key_[0], &leaf[0]))
+  if (bpf_lookup_elem(module_->table_fd(id_), key_data(), &leaf[0]))
     return 0;
-  if (bpf_table_leaf_snprintf(md->mod(), md->map_id(), &leaf_str[0], leaf_size_ * 8, &leaf[0]))
+  if (module_->leaf_snprintf(id_, &leaf_str[0], leaf_size() * 8, &leaf[0]))
     return -EIO;
+  lock_guard<mutex> guard(mutex_);
+  if (writing_locked())
+    return 0;
   data_ = string(&leaf_str[0]) + "\n";
+  raw_ = false;
   return 0;
 }
 
+// Keeps an open entry in its directory until release
+struct EntryPin : public FileHandle {
+  EntryPin(shared_ptr<MapEntry> e, bool w) : entry(move(e)), write(w) { entry->pin(write); }
+  ~EntryPin() { entry->unpin(write); }
+  shared_ptr<MapEntry> entry;
+  bool write;
+};
+
 int MapEntry::open(struct fuse_file_info *fi) {
   if (int rc = refresh())
     return rc;
-  return File::open(fi);
+  auto self = std::static_pointer_cast<MapEntry>(shared_from_this());
+  bool write = (fi->flags & O_ACCMODE) != O_RDONLY;
+  fi->fh = (uintptr_t)static_cast<FileHandle *>(new EntryPin(self, write));
+  return 0;
+}
+
+MapRawEntry::MapRawEntry(shared_ptr<Module> module, int id, string key)
+    : File(), module_(module), id_(id), key_(move(key)) {
+}
+
+int MapRawEntry::getattr(struct stat *st) {
+  unique_ptr<uint8_t[]> leaf(new uint8_t[module_->leaf_size(id_)]);
+  if (bpf_lookup_elem(module_->table_fd(id_), &key_[0], &leaf[0]))
+    return -ENOENT;
+  return File::getattr(st);
+}
+
+size_t MapRawEntry::size() const {
+  return module_->leaf_size(id_);
+}
+
+// Keeps an entry its directory has evicted answering until release
+struct EntryRef : public FileHandle {
+  explicit EntryRef(shared_ptr<Inode> n) : node(move(n)) {}
+  shared_ptr<Inode> node;
+};
+
+int MapRawEntry::open(struct fuse_file_info *fi) {
+  // each read looks the value up again
+  fi->direct_io = 1;
+  fi->fh = (uintptr_t)static_cast<FileHandle *>(new EntryRef(shared_from_this()));
+  return 0;
+}
+
+int MapRawEntry::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  size_t leaf_size = module_->leaf_size(id_);
+  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size]);
+  if (bpf_lookup_elem(module_->table_fd(id_), &key_[0], &leaf[0]))
+    return -ENOENT;
+  if (offset >= (off_t)leaf_size)
+    return 0;
+  size = std::min(size, leaf_size - (size_t)offset);
+  memcpy(buf, &leaf[offset], size);
+  return size;
 }
 
 }  // namespace bcc
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "module.h"
+#include "string_util.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+// Integers are written as libbcc writes them ("0x%x" and friends, so in
+// hex and without sign) and read as it reads them ("%i", so in any base).
+typedef char * (*PutFn)(char *p, char *end, const uint8_t *src);
+typedef const char * (*GetFn)(const char *p, uint8_t *dst);
+
+template <typename T>
+char * put_int(char *p, char *end, const uint8_t *src) {
+  T v;
+  memcpy(&v, src, sizeof(v));
+  char tmp[2 + 2 * sizeof(T)];
+  char *q = tmp + sizeof(tmp);
+  do {
+    *--q = "0123456789abcdef"[v & 0xf];
+    v >>= 4;
+  } while (v);
+  *--q = 'x';
+  *--q = '0';
+  size_t n = tmp + sizeof(tmp) - q;
+  if ((size_t)(end - p) < n)
+    return nullptr;
+  memcpy(p, q, n);
+  return p + n;
+}
+
+template <typename T>
+const char * get_int(const char *p, uint8_t *dst) {
+  char *end;
+  // negative numbers wrap, as they do through scanf
+  T v = (T)strtoull(p, &end, 0);
+  // "0x1foo" is not 0x1
+  if (end == p || !(!*end || isspace(*end) || *end == ']' || *end == '}'))
+    return nullptr;
+  memcpy(dst, &v, sizeof(v));
+  return end;
+}
+
+struct IntOps {
+  size_t width;
+  PutFn put;
+  GetFn get;
+};
+
+const IntOps int_ops[] = {
+  {1, put_int<uint8_t>, get_int<uint8_t>},
+  {2, put_int<uint16_t>, get_int<uint16_t>},
+  {4, put_int<uint32_t>, get_int<uint32_t>},
+  {8, put_int<uint64_t>, get_int<uint64_t>},
+};
+
+// Integer types by the name libbcc gives them in a description. Wider or
+// floating point types are not handled.
+const IntOps * find_int(const string &name) {
+  static const struct {
+    const char *name;
+    size_t width;
+  } names[] = {
+    {"char", 1}, {"signed char", 1}, {"unsigned char", 1}, {"_Bool", 1},
+    {"short", 2}, {"unsigned short", 2}, {"short int", 2}, {"short unsigned int", 2},
+    {"int", 4}, {"unsigned int", 4}, {"unsigned", 4},
+    {"long", 8}, {"unsigned long", 8}, {"long int", 8}, {"long unsigned int", 8},
+    {"long long", 8}, {"unsigned long long", 8},
+    {"long long int", 8}, {"long long unsigned int", 8},
+    {"u8", 1}, {"u16", 2}, {"u32", 4}, {"u64", 8},
+    {"s8", 1}, {"s16", 2}, {"s32", 4}, {"s64", 8},
+    {"__u8", 1}, {"__u16", 2}, {"__u32", 4}, {"__u64", 8},
+    {"__s8", 1}, {"__s16", 2}, {"__s32", 4}, {"__s64", 8},
+    {"uint8_t", 1}, {"uint16_t", 2}, {"uint32_t", 4}, {"uint64_t", 8},
+    {"int8_t", 1}, {"int16_t", 2}, {"int32_t", 4}, {"int64_t", 8},
+  };
+  for (auto &n : names) {
+    if (name != n.name)
+      continue;
+    for (auto &ops : int_ops) {
+      if (ops.width == n.width)
+        return &ops;
+    }
+  }
+  return nullptr;
+}
+
+// A description is JSON made of strings, numbers and lists, e.g.
+// "unsigned int" or ["key", [["pid", "int"], ["comm", "char", [16]]], "struct"]
+struct Desc {
+  enum { str_e, num_e, list_e } type;
+  string str;
+  size_t num;
+  vector<Desc> list;
+};
+
+const char * skip_space(const char *p) {
+  while (isspace(*p))
+    ++p;
+  return p;
+}
+
+const char * parse_desc(const char *p, Desc *d, int depth) {
+  p = skip_space(p);
+  if (depth > 8)
+    return nullptr;
+  if (*p == '"') {
+    const char *end = strchr(p + 1, '"');
+    if (!end)
+      return nullptr;
+    d->type = Desc::str_e;
+    d->str.assign(p + 1, end);
+    return end + 1;
+  }
+  if (isdigit(*p)) {
+    char *end;
+    d->type = Desc::num_e;
+    d->num = strtoul(p, &end, 10);
+    return end;
+  }
+  if (*p != '[')
+    return nullptr;
+  d->type = Desc::list_e;
+  p = skip_space(p + 1);
+  if (*p == ']')
+    return p + 1;
+  for (;;) {
+    d->list.emplace_back();
+    p = parse_desc(p, &d->list.back(), depth + 1);
+    if (!p)
+      return nullptr;
+    p = skip_space(p);
+    if (*p == ']')
+      return p + 1;
+    if (*p != ',')
+      return nullptr;
+    ++p;
+  }
+}
+
+// An integer, with nothing around it
+template <typename T>
+class IntFormat : public Format {
+ public:
+  int snprintf(char *buf, size_t buflen, const void *data) const override {
+    char *p = put_int<T>(buf, buf + buflen, (const uint8_t *)data);
+    if (!p || p == buf + buflen)
+      return -1;
+    *p = '\0';
+    return 0;
+  }
+  int sscanf(const char *buf, void *data) const override {
+    const char *p = get_int<T>(buf, (uint8_t *)data);
+    return p && !*skip_space(p) ? 0 : -1;
+  }
+};
+
+// A struct of integers, structs and arrays of them, written
+// "{ a [ b c ] { d } }"
+class LayoutFormat : public Format {
+ public:
+  struct Field {
+    size_t offset;
+    // of one element
+    size_t width;
+    // 0 if not an array
+    size_t count;
+    // integers have put and get, structs a layout
+    PutFn put;
+    GetFn get;
+    std::shared_ptr<const LayoutFormat> layout;
+  };
+  explicit LayoutFormat(vector<Field> fields) : fields_(std::move(fields)) {}
+
+  int snprintf(char *buf, size_t buflen, const void *data) const override {
+    char *p = put(buf, buf + buflen, (const uint8_t *)data);
+    if (!p || p == buf + buflen)
+      return -1;
+    *p = '\0';
+    return 0;
+  }
+
+  int sscanf(const char *buf, void *data) const override {
+    const char *p = get(buf, (uint8_t *)data);
+    return p && !*skip_space(p) ? 0 : -1;
+  }
+
+  char * put(char *p, char *end, const uint8_t *src) const {
+    if (!(p = put_str(p, end, "{ ")))
+      return nullptr;
+    for (auto &f : fields_) {
+      if (!f.count) {
+        if (!(p = put_field(f, p, end, src + f.offset)) || !(p = put_str(p, end, " ")))
+          return nullptr;
+        continue;
+      }
+      if (!(p = put_str(p, end, "[ ")))
+        return nullptr;
+      for (size_t i = 0; i < f.count; ++i) {
+        if (!(p = put_field(f, p, end, src + f.offset + i * f.width)) ||
+            !(p = put_str(p, end, " ")))
+          return nullptr;
+      }
+      if (!(p = put_str(p, end, "] ")))
+        return nullptr;
+    }
+    return put_str(p, end, "}");
+  }
+
+  const char * get(const char *p, uint8_t *dst) const {
+    if (!(p = get_char(p, '{')))
+      return nullptr;
+    for (auto &f : fields_) {
+      if (!f.count) {
+        if (!(p = get_field(f, p, dst + f.offset)))
+          return nullptr;
+        continue;
+      }
+      if (!(p = get_char(p, '[')))
+        return nullptr;
+      for (size_t i = 0; i < f.count; ++i) {
+        if (!(p = get_field(f, p, dst + f.offset + i * f.width)))
+          return nullptr;
+      }
+      if (!(p = get_char(p, ']')))
+        return nullptr;
+    }
+    return get_char(p, '}');
+  }
+
+ private:
+  static char * put_field(const Field &f, char *p, char *end, const uint8_t *src) {
+    return f.layout ? f.layout->put(p, end, src) : f.put(p, end, src);
+  }
+  static const char * get_field(const Field &f, const char *p, uint8_t *dst) {
+    return f.layout ? f.layout->get(p, dst) : f.get(p, dst);
+  }
+  static char * put_str(char *p, char *end, const char *s) {
+    size_t n = strlen(s);
+    if ((size_t)(end - p) < n)
+      return nullptr;
+    memcpy(p, s, n);
+    return p + n;
+  }
+  static const char * get_char(const char *p, char c) {
+    p = skip_space(p);
+    return *p == c ? p + 1 : nullptr;
+  }
+  vector<Field> fields_;
+};
+
+// The bytes as they are, in hex, as raw/ names keys
+class HexFormat : public Format {
+ public:
+  explicit HexFormat(size_t size) : size_(size) {}
+  int snprintf(char *buf, size_t buflen, const void *data) const override {
+    if (buflen <= 2 * size_)
+      return -1;
+    hex_encode((const uint8_t *)data, size_, buf);
+    buf[2 * size_] = '\0';
+    return 0;
+  }
+  int sscanf(const char *buf, void *data) const override {
+    // stops at the terminator of a shorter buf
+    if (!hex_decode(buf, size_, (uint8_t *)data))
+      return -1;
+    return *skip_space(buf + 2 * size_) ? -1 : 0;
+  }
+ private:
+  size_t size_;
+};
+
+std::shared_ptr<LayoutFormat> make_layout(const Desc &d, size_t *size, size_t *align);
+
+// Appends the field described by d (["name", type] or ["name", type,
+// [count]], type being an integer type or a struct) at the next offset,
+// aligned as the compiler would.
+bool add_field(const Desc &d, size_t *offset, size_t *align,
+               vector<LayoutFormat::Field> *fields) {
+  if (d.type != Desc::list_e || d.list.size() < 2 || d.list.size() > 3)
+    return false;
+  LayoutFormat::Field f{0, 0, 0, nullptr, nullptr, nullptr};
+  size_t field_align;
+  if (d.list[1].type == Desc::str_e) {
+    const IntOps *ops = find_int(d.list[1].str);
+    if (!ops)
+      return false;
+    f.width = field_align = ops->width;
+    f.put = ops->put;
+    f.get = ops->get;
+  } else if (!(f.layout = make_layout(d.list[1], &f.width, &field_align))) {
+    return false;
+  }
+  if (d.list.size() == 3) {
+    // anything else there is a bitfield
+    const Desc &dims = d.list[2];
+    if (dims.type != Desc::list_e || dims.list.size() != 1 ||
+        dims.list[0].type != Desc::num_e || !dims.list[0].num)
+      return false;
+    f.count = dims.list[0].num;
+  }
+  *offset = (*offset + field_align - 1) / field_align * field_align;
+  *align = std::max(*align, field_align);
+  f.offset = *offset;
+  *offset += f.width * (f.count ? f.count : 1);
+  fields->push_back(std::move(f));
+  return true;
+}
+
+// ["name", [fields...]], optionally followed by "struct"; unions, bitfields
+// and packed layouts are not handled
+std::shared_ptr<LayoutFormat> make_layout(const Desc &d, size_t *size, size_t *align) {
+  if (d.type != Desc::list_e || d.list.size() < 2 || d.list.size() > 3 ||
+      d.list[0].type != Desc::str_e || d.list[1].type != Desc::list_e ||
+      d.list[1].list.empty())
+    return nullptr;
+  if (d.list.size() == 3 && (d.list[2].type != Desc::str_e || d.list[2].str != "struct"))
+    return nullptr;
+  vector<LayoutFormat::Field> fields;
+  size_t offset = 0;
+  *align = 1;
+  for (auto &field : d.list[1].list) {
+    if (!add_field(field, &offset, align, &fields))
+      return nullptr;
+  }
+  *size = (offset + *align - 1) / *align * *align;
+  return std::make_shared<LayoutFormat>(std::move(fields));
+}
+
+}  // namespace
+
+unique_ptr<Format> Format::create(const char *desc, size_t size) {
+  Desc d;
+  const char *end = parse_desc(desc, &d, 0);
+  if (!end || *skip_space(end))
+    return nullptr;
+
+  if (d.type == Desc::str_e) {
+    const IntOps *ops = find_int(d.str);
+    if (!ops || ops->width != size)
+      return nullptr;
+    switch (size) {
+      case 1: return unique_ptr<Format>(new IntFormat<uint8_t>);
+      case 2: return unique_ptr<Format>(new IntFormat<uint16_t>);
+      case 4: return unique_ptr<Format>(new IntFormat<uint32_t>);
+      case 8: return unique_ptr<Format>(new IntFormat<uint64_t>);
+    }
+    return nullptr;
+  }
+
+  size_t layout_size, align;
+  auto layout = make_layout(d, &layout_size, &align);
+  if (!layout || layout_size != size)
+    return nullptr;
+  return unique_ptr<Format>(new LayoutFormat(std::move(*layout)));
+}
+
+unique_ptr<Format> Format::hex(size_t size) {
+  return unique_ptr<Format>(new HexFormat(size));
+}
+
+}  // namespace bcc
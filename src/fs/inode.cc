@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <string>
 #include "mount.h"
 
@@ -22,14 +23,89 @@ using std::string;
 namespace bcc {
 
 Inode::Inode(InodeType type, mode_t mode)
-    : parent_(nullptr), type_(type), mode_(mode) {
+    : type_(type), mode_(mode) {
   mount_ = Mount::instance();
+  ino_ = mount_->inodes().add();
+}
+
+Inode::~Inode() {
+  mount_->inodes().remove(ino_);
 }
 
 string Inode::path() const {
-  if (parent_)
-    return parent_->path(this);
+  if (auto parent = parent_.lock())
+    return parent->path(this);
   return mount_->mountpath();
 }
 
+InodeTable::InodeTable() {
+  // ino 0 is never valid, so that the first node added gets FUSE_ROOT_ID
+  slots_.push_back(Slot{std::weak_ptr<Inode>(), true, 0, 1});
+}
+
+fuse_ino_t InodeTable::add() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  fuse_ino_t ino;
+  if (free_.empty()) {
+    ino = slots_.size();
+    slots_.push_back(Slot{std::weak_ptr<Inode>(), true, 0, 0});
+  } else {
+    ino = free_.back();
+    free_.pop_back();
+    slots_[ino].live = true;
+  }
+  return ino;
+}
+
+void InodeTable::remove(fuse_ino_t ino) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (ino >= slots_.size())
+    return;
+  slots_[ino].node.reset();
+  slots_[ino].live = false;
+  if (!slots_[ino].nlookup)
+    release(ino);
+}
+
+std::shared_ptr<Inode> InodeTable::get(fuse_ino_t ino) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (ino >= slots_.size())
+    return nullptr;
+  return slots_[ino].node.lock();
+}
+
+uint64_t InodeTable::generation(fuse_ino_t ino) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (ino >= slots_.size())
+    return 0;
+  return slots_[ino].generation;
+}
+
+void InodeTable::lookup(const std::shared_ptr<Inode> &node) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  fuse_ino_t ino = node->ino();
+  if (ino >= slots_.size())
+    return;
+  if (!slots_[ino].nlookup)
+    slots_[ino].node = node;
+  ++slots_[ino].nlookup;
+}
+
+void InodeTable::forget(fuse_ino_t ino, uint64_t nlookup) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (ino >= slots_.size())
+    return;
+  Slot &slot = slots_[ino];
+  slot.nlookup -= std::min(nlookup, slot.nlookup);
+  if (!slot.nlookup && !slot.live)
+    release(ino);
+}
+
+void InodeTable::release(fuse_ino_t ino) {
+  // the kernel may still hand back (ino, generation) from an old lookup, so
+  // the next owner of this slot must not share its generation
+  ++slots_[ino].generation;
+  free_.push_back(ino);
+}
+
 }  // namespace bcc
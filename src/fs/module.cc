@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <bcc/bpf_common.h>
+#include <bcc/libbpf.h>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "module.h"
+
+// set by the build from pkg-config, part of the disk cache key
+#ifndef LIBBCC_VERSION
+#define LIBBCC_VERSION "unknown"
+#endif
+
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+const char cache_magic[8] = {'B', 'C', 'C', 'F', 'U', 'S', 'E', 2};
+
+// flat, host endian encoding of artifacts for the disk cache
+class Writer {
+ public:
+  void put32(uint32_t v) { buf_.append((const char *)&v, sizeof(v)); }
+  void put64(uint64_t v) { buf_.append((const char *)&v, sizeof(v)); }
+  void put(const void *data, size_t size) {
+    put64(size);
+    buf_.append((const char *)data, size);
+  }
+  void put(const string &s) { put(s.data(), s.size()); }
+  const string & data() const { return buf_; }
+ private:
+  string buf_;
+};
+
+class Reader {
+ public:
+  Reader(const string &buf, size_t pos) : buf_(buf), pos_(pos), ok_(true) {}
+  uint32_t get32() {
+    uint32_t v = 0;
+    copy(&v, sizeof(v));
+    return v;
+  }
+  uint64_t get64() {
+    uint64_t v = 0;
+    copy(&v, sizeof(v));
+    return v;
+  }
+  string get() {
+    uint64_t size = get64();
+    if (!ok_ || size > buf_.size() - pos_) {
+      ok_ = false;
+      return string();
+    }
+    pos_ += size;
+    return buf_.substr(pos_ - size, size);
+  }
+  bool good() const { return ok_; }
+  // everything was read, and nothing more
+  bool ok() const { return ok_ && pos_ == buf_.size(); }
+ private:
+  void copy(void *v, size_t size) {
+    if (!ok_ || size > buf_.size() - pos_) {
+      ok_ = false;
+      return;
+    }
+    memcpy(v, &buf_[pos_], size);
+    pos_ += size;
+  }
+  const string &buf_;
+  size_t pos_;
+  bool ok_;
+};
+
+}  // namespace
+
+uint64_t Artifact::hash(const string &text, unsigned flags) {
+  // FNV-1a, over the text and then the flags
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : text) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  for (size_t i = 0; i < sizeof(flags); ++i) {
+    h ^= (flags >> (i * 8)) & 0xff;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+shared_ptr<Artifact> Artifact::compile(const string &text, unsigned flags) {
+  void *m = bpf_module_create_c_from_string(text.c_str(), flags);
+  if (!m)
+    return nullptr;
+  // Only the bytecode and table layout are kept. The compiler's maps go
+  // with its module, and every load creates its own.
+  std::unique_ptr<void, void (*)(void *)> module(m, bpf_module_destroy);
+  auto art = std::make_shared<Artifact>();
+  art->key = hash(text, flags);
+  art->flags = flags;
+  art->text = text;
+  if (const char *license = bpf_module_license(m))
+    art->license = license;
+  art->kern_version = bpf_module_kern_version(m);
+
+  size_t num_functions = bpf_num_functions(m);
+  for (size_t i = 0; i < num_functions; ++i) {
+    auto start = (const struct bpf_insn *)bpf_function_start_id(m, i);
+    size_t count = bpf_function_size_id(m, i) / sizeof(struct bpf_insn);
+    art->functions.push_back(Function{bpf_function_name(m, i),
+                                      vector<struct bpf_insn>(start, start + count)});
+  }
+  size_t num_tables = bpf_num_tables(m);
+  for (size_t i = 0; i < num_tables; ++i) {
+    const char *key_desc = bpf_table_key_desc_id(m, i);
+    const char *leaf_desc = bpf_table_leaf_desc_id(m, i);
+    art->tables.push_back(Table{bpf_table_name(m, i), bpf_table_type_id(m, i),
+                                bpf_table_key_size_id(m, i), bpf_table_leaf_size_id(m, i),
+                                bpf_table_max_entries_id(m, i), bpf_table_fd_id(m, i),
+                                key_desc ? key_desc : "", leaf_desc ? leaf_desc : ""});
+  }
+  art->set_formats();
+  return art;
+}
+
+void Artifact::set_formats() {
+  formats_.clear();
+  for (auto &t : tables) {
+    std::unique_ptr<Format> key = Format::create(t.key_desc.c_str(), t.key_size);
+    std::unique_ptr<Format> leaf = Format::create(t.leaf_desc.c_str(), t.leaf_size);
+    formats_.push_back(key ? std::move(key) : Format::hex(t.key_size));
+    formats_.push_back(leaf ? std::move(leaf) : Format::hex(t.leaf_size));
+  }
+}
+
+const Format * Artifact::format(size_t i) const {
+  return i < formats_.size() ? formats_[i].get() : nullptr;
+}
+
+shared_ptr<Module> Module::create(shared_ptr<Artifact> artifact, const Module *previous) {
+  shared_ptr<Module> mod(new Module(artifact));
+  for (auto &table : artifact->tables) {
+    // A map carried over is a duplicate fd, so that it stays open however
+    // long the previous module lives.
+    int old_fd = find_map(previous, table);
+    if (old_fd >= 0) {
+      int fd = dup(old_fd);
+      if (fd < 0)
+        return nullptr;
+      mod->fds_.push_back(fd);
+      mod->owned_fds_.push_back(fd);
+      continue;
+    }
+    int fd = bpf_create_map((enum bpf_map_type)table.type, table.key_size,
+                            table.leaf_size, table.max_entries);
+    if (fd < 0)
+      return nullptr;
+    mod->fds_.push_back(fd);
+    mod->owned_fds_.push_back(fd);
+  }
+  if (mod->relocate())
+    return nullptr;
+  return mod;
+}
+
+int Module::find_map(const Module *previous, const Artifact::Table &table) {
+  if (!previous)
+    return -1;
+  for (size_t i = 0; i < previous->num_tables(); ++i) {
+    const Artifact::Table &old = previous->artifact_->tables[i];
+    if (old.name == table.name && old.type == table.type &&
+        old.key_size == table.key_size && old.leaf_size == table.leaf_size &&
+        old.max_entries == table.max_entries)
+      return previous->fds_[i];
+  }
+  return -1;
+}
+
+Module::~Module() {
+  for (int fd : owned_fds_)
+    close(fd);
+}
+
+int Module::relocate() {
+  std::unordered_map<int, int> fds;
+  for (size_t i = 0; i < fds_.size(); ++i)
+    fds[artifact_->tables[i].fd] = fds_[i];
+  for (auto &fn : artifact_->functions) {
+    insns_.push_back(fn.insns);
+    auto &insns = insns_.back();
+    for (size_t i = 0; i < insns.size(); ++i) {
+      if (insns[i].code != (BPF_LD | BPF_IMM | BPF_DW))
+        continue;
+      if (insns[i].src_reg == BPF_PSEUDO_MAP_FD) {
+        auto it = fds.find(insns[i].imm);
+        if (it == fds.end())
+          return -1;
+        insns[i].imm = it->second;
+      }
+      // skip the second half of the 16 byte load
+      ++i;
+    }
+  }
+  return 0;
+}
+
+string Module::key_desc(size_t id) const {
+  return artifact_->tables[id].key_desc;
+}
+
+string Module::leaf_desc(size_t id) const {
+  return artifact_->tables[id].leaf_desc;
+}
+
+int Module::key_snprintf(size_t id, char *buf, size_t buflen, const void *key) const {
+  const Format *format = artifact_->key_format(id);
+  return format ? format->snprintf(buf, buflen, key) : -1;
+}
+
+int Module::leaf_snprintf(size_t id, char *buf, size_t buflen, const void *leaf) const {
+  const Format *format = artifact_->leaf_format(id);
+  return format ? format->snprintf(buf, buflen, leaf) : -1;
+}
+
+int Module::key_sscanf(size_t id, const char *buf, void *key) const {
+  const Format *format = artifact_->key_format(id);
+  return format ? format->sscanf(buf, key) : -1;
+}
+
+int Module::leaf_sscanf(size_t id, const char *buf, void *leaf) const {
+  const Format *format = artifact_->leaf_format(id);
+  return format ? format->sscanf(buf, leaf) : -1;
+}
+
+ModuleCache::ModuleCache(size_t capacity)
+    : capacity_(capacity), hits_(0), misses_(0), evictions_(0) {
+}
+
+void ModuleCache::set_capacity(size_t capacity) {
+  lock_guard<mutex> guard(mutex_);
+  capacity_ = capacity;
+}
+
+shared_ptr<Artifact> ModuleCache::find(const string &text, unsigned flags) {
+  lock_guard<mutex> guard(mutex_);
+  if (!capacity_)
+    return nullptr;
+  auto range = index_.equal_range(Artifact::hash(text, flags));
+  for (auto it = range.first; it != range.second; ++it) {
+    const Artifact &art = **it->second;
+    if (art.flags == flags && art.text == text) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      ++hits_;
+      return lru_.front();
+    }
+  }
+  ++misses_;
+  return nullptr;
+}
+
+void ModuleCache::insert(shared_ptr<Artifact> artifact) {
+  lock_guard<mutex> guard(mutex_);
+  if (!capacity_)
+    return;
+  auto range = index_.equal_range(artifact->key);
+  for (auto it = range.first; it != range.second; ++it) {
+    // compiled twice by concurrent loads, keep the first
+    if ((*it->second)->flags == artifact->flags && (*it->second)->text == artifact->text)
+      return;
+  }
+  lru_.push_front(artifact);
+  index_.emplace(artifact->key, lru_.begin());
+  while (lru_.size() > capacity_) {
+    auto last = std::prev(lru_.end());
+    auto entries = index_.equal_range((*last)->key);
+    for (auto it = entries.first; it != entries.second; ++it) {
+      if (it->second == last) {
+        index_.erase(it);
+        break;
+      }
+    }
+    lru_.pop_back();
+    ++evictions_;
+  }
+}
+
+string ModuleCache::stats() const {
+  lock_guard<mutex> guard(mutex_);
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "module_cache_hits=%" PRIu64 "\nmodule_cache_misses=%" PRIu64 "\n"
+           "module_cache_evictions=%" PRIu64 "\nmodule_cache_entries=%zu\n",
+           hits_, misses_, evictions_, lru_.size());
+  return buf;
+}
+
+DiskCache::DiskCache()
+    : max_bytes_(0), build_hash_(0), hits_(0), misses_(0), errors_(0), evictions_(0) {
+}
+
+int DiskCache::init(const string &dir, size_t max_bytes) {
+  lock_guard<mutex> guard(mutex_);
+  dir_.clear();
+  if (dir.empty())
+    return 0;
+  if (::mkdir(dir.c_str(), 0700) && errno != EEXIST)
+    return -errno;
+  if (access(dir.c_str(), R_OK | W_OK | X_OK))
+    return -errno;
+  struct utsname uts;
+  if (uname(&uts))
+    return -errno;
+  // Artifacts are only reused by the libbcc and kernel they came from, the
+  // bytecode depends on both.
+  build_ = string("libbcc ") + LIBBCC_VERSION + ", kernel " + uts.release;
+  build_hash_ = Artifact::hash(build_, 0);
+  dir_ = dir;
+  max_bytes_ = max_bytes;
+  return 0;
+}
+
+string DiskCache::path(uint64_t key) const {
+  char name[64];
+  snprintf(name, sizeof(name), "/%016" PRIx64 "-%016" PRIx64 ".bpf", key, build_hash_);
+  return dir_ + name;
+}
+
+shared_ptr<Artifact> DiskCache::find(const string &text, unsigned flags) {
+  string file;
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (dir_.empty())
+      return nullptr;
+    file = path(Artifact::hash(text, flags));
+  }
+  string buf;
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    char chunk[16 * 1024];
+    ssize_t n;
+    while ((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+      buf.append(chunk, n);
+    ::close(fd);
+  }
+
+  lock_guard<mutex> guard(mutex_);
+  if (fd < 0) {
+    ++misses_;
+    return nullptr;
+  }
+  size_t header = sizeof(cache_magic) + sizeof(uint64_t);
+  uint64_t checksum = 0;
+  if (buf.size() >= header)
+    memcpy(&checksum, &buf[sizeof(cache_magic)], sizeof(checksum));
+  if (buf.size() < header || memcmp(&buf[0], cache_magic, sizeof(cache_magic)) ||
+      checksum != Artifact::hash(buf.substr(header), 0)) {
+    // torn or corrupted, let the next compile replace it
+    unlink(file.c_str());
+    ++errors_;
+    return nullptr;
+  }
+
+  auto art = std::make_shared<Artifact>();
+  Reader r(buf, header);
+  string build = r.get();
+  art->flags = r.get32();
+  art->text = r.get();
+  art->license = r.get();
+  art->kern_version = r.get32();
+  for (uint32_t n = r.get32(); n && r.good(); --n) {
+    Artifact::Function fn;
+    fn.name = r.get();
+    string insns = r.get();
+    fn.insns.resize(insns.size() / sizeof(struct bpf_insn));
+    memcpy(fn.insns.data(), insns.data(), fn.insns.size() * sizeof(struct bpf_insn));
+    art->functions.push_back(std::move(fn));
+  }
+  for (uint32_t n = r.get32(); n && r.good(); --n) {
+    Artifact::Table t;
+    t.name = r.get();
+    t.type = r.get32();
+    t.key_size = r.get64();
+    t.leaf_size = r.get64();
+    t.max_entries = r.get64();
+    t.fd = r.get32();
+    t.key_desc = r.get();
+    t.leaf_desc = r.get();
+    art->tables.push_back(std::move(t));
+  }
+  if (!r.ok() || build != build_) {
+    unlink(file.c_str());
+    ++errors_;
+    return nullptr;
+  }
+  if (art->flags != flags || art->text != text) {
+    // another source with the same hash
+    ++misses_;
+    return nullptr;
+  }
+  art->key = Artifact::hash(text, flags);
+  art->set_formats();
+  // there are no compiler maps to take over
+  // mark as recently used, for eviction
+  utimes(file.c_str(), nullptr);
+  ++hits_;
+  return art;
+}
+
+void DiskCache::store(const Artifact &artifact) {
+  string file, tmp;
+  Writer w;
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (dir_.empty())
+      return;
+    file = path(artifact.key);
+    tmp = dir_ + "/.tmp-XXXXXX";
+    w.put(build_);
+  }
+  w.put32(artifact.flags);
+  w.put(artifact.text);
+  w.put(artifact.license);
+  w.put32(artifact.kern_version);
+  w.put32(artifact.functions.size());
+  for (auto &fn : artifact.functions) {
+    w.put(fn.name);
+    w.put(fn.insns.data(), fn.insns.size() * sizeof(struct bpf_insn));
+  }
+  w.put32(artifact.tables.size());
+  for (auto &t : artifact.tables) {
+    w.put(t.name);
+    w.put32(t.type);
+    w.put64(t.key_size);
+    w.put64(t.leaf_size);
+    w.put64(t.max_entries);
+    w.put32(t.fd);
+    w.put(t.key_desc);
+    w.put(t.leaf_desc);
+  }
+  uint64_t checksum = Artifact::hash(w.data(), 0);
+  string buf(cache_magic, sizeof(cache_magic));
+  buf.append((const char *)&checksum, sizeof(checksum));
+  buf += w.data();
+
+  int fd = mkstemp(&tmp[0]);
+  bool ok = fd >= 0;
+  for (size_t off = 0; ok && off < buf.size(); ) {
+    ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+    if (n < 0 && errno != EINTR)
+      ok = false;
+    else if (n > 0)
+      off += n;
+  }
+  if (fd >= 0 && ::close(fd))
+    ok = false;
+  if (ok)
+    ok = rename(tmp.c_str(), file.c_str()) == 0;
+  lock_guard<mutex> guard(mutex_);
+  if (!ok) {
+    if (fd >= 0)
+      unlink(tmp.c_str());
+    ++errors_;
+    return;
+  }
+  evict();
+}
+
+// called with mutex_ held
+void DiskCache::evict() {
+  struct Entry {
+    time_t mtime;
+    size_t size;
+    string name;
+  };
+  vector<Entry> entries;
+  size_t total = 0;
+  DIR *d = opendir(dir_.c_str());
+  if (!d)
+    return;
+  while (struct dirent *ent = readdir(d)) {
+    size_t len = strlen(ent->d_name);
+    if (len < 4 || strcmp(ent->d_name + len - 4, ".bpf"))
+      continue;
+    string name = dir_ + "/" + ent->d_name;
+    struct stat st;
+    if (stat(name.c_str(), &st))
+      continue;
+    entries.push_back(Entry{st.st_mtime, (size_t)st.st_size, name});
+    total += st.st_size;
+  }
+  closedir(d);
+  if (total <= max_bytes_)
+    return;
+  std::sort(entries.begin(), entries.end(),
+            [] (const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+  for (auto &e : entries) {
+    if (total <= max_bytes_)
+      break;
+    if (unlink(e.name.c_str()) == 0) {
+      total -= e.size;
+      ++evictions_;
+    }
+  }
+}
+
+string DiskCache::stats() const {
+  lock_guard<mutex> guard(mutex_);
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "disk_cache_hits=%" PRIu64 "\ndisk_cache_misses=%" PRIu64 "\n"
+           "disk_cache_errors=%" PRIu64 "\ndisk_cache_evictions=%" PRIu64 "\n",
+           hits_, misses_, errors_, evictions_);
+  return buf;
+}
+
+}  // namespace bcc
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <linux/bpf.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bcc {
+
+// Formats and parses keys or leaves of a common layout (an integer, or a
+// struct of integers, structs and arrays of them) in the same text form
+// libbcc uses, without interpreting the type description on every call.
+class Format {
+ public:
+  // Returns nullptr if desc, libbcc's description of a type of size bytes,
+  // is not a layout handled here.
+  static std::unique_ptr<Format> create(const char *desc, size_t size);
+  // The bytes in hex, for any other layout
+  static std::unique_ptr<Format> hex(size_t size);
+  virtual ~Format() {}
+  // like bpf_table_key_snprintf() and bpf_table_key_sscanf()
+  virtual int snprintf(char *buf, size_t buflen, const void *data) const = 0;
+  virtual int sscanf(const char *buf, void *data) const = 0;
+};
+
+// The output of one compile, independent of the maps of any single load:
+// bytecode as relocated against the compiler's maps, which are closed once
+// it is read out, plus the table layout. Entries are formatted from the type descriptions alone, so an
+// artifact read back from disk needs no libbcc module.
+struct Artifact {
+  struct Function {
+    std::string name;
+    std::vector<struct bpf_insn> insns;
+  };
+  struct Table {
+    std::string name;
+    int type;
+    size_t key_size;
+    size_t leaf_size;
+    size_t max_entries;
+    // fd the compiler's map had, as found in the bytecode
+    int fd;
+    // libbcc's description of the key and leaf types, empty if unknown
+    std::string key_desc;
+    std::string leaf_desc;
+  };
+  static std::shared_ptr<Artifact> compile(const std::string &text, unsigned flags);
+  static uint64_t hash(const std::string &text, unsigned flags);
+  // Formats of the key and leaf of table id, built from the descriptions in
+  // tables. Layouts Format does not handle are written in hex.
+  const Format * key_format(size_t id) const { return format(2 * id); }
+  const Format * leaf_format(size_t id) const { return format(2 * id + 1); }
+
+  uint64_t key;
+  unsigned flags;
+  std::string text;
+  std::string license;
+  unsigned kern_version;
+  std::vector<Function> functions;
+  std::vector<Table> tables;
+
+ private:
+  friend class DiskCache;
+  // fills formats_ from the descriptions in tables
+  void set_formats();
+  const Format * format(size_t i) const;
+  // set before the artifact is shared, and never changed after
+  std::vector<std::unique_ptr<Format>> formats_;
+};
+
+// A loaded program: an Artifact with maps of its own, and the bytecode
+// relocated to use them.
+class Module {
+ public:
+  // Returns nullptr if the maps could not be created. Maps of previous that
+  // match a table in name and layout are shared instead of created.
+  static std::shared_ptr<Module> create(std::shared_ptr<Artifact> artifact,
+                                        const Module *previous = nullptr);
+  ~Module();
+  Module(const Module &) = delete;
+
+  const Artifact & artifact() const { return *artifact_; }
+  const char * license() const { return artifact_->license.c_str(); }
+  unsigned kern_version() const { return artifact_->kern_version; }
+
+  size_t num_functions() const { return artifact_->functions.size(); }
+  const std::string & function_name(size_t id) const { return artifact_->functions[id].name; }
+  const struct bpf_insn * function_start(size_t id) const { return insns_[id].data(); }
+  // in bytes, like bpf_function_size()
+  size_t function_size(size_t id) const { return insns_[id].size() * sizeof(struct bpf_insn); }
+
+  size_t num_tables() const { return artifact_->tables.size(); }
+  const std::string & table_name(size_t id) const { return artifact_->tables[id].name; }
+  int table_fd(size_t id) const { return fds_[id]; }
+  size_t key_size(size_t id) const { return artifact_->tables[id].key_size; }
+  size_t leaf_size(size_t id) const { return artifact_->tables[id].leaf_size; }
+  // libbcc's description of the key and leaf types, empty if unknown
+  std::string key_desc(size_t id) const;
+  std::string leaf_desc(size_t id) const;
+  int key_snprintf(size_t id, char *buf, size_t buflen, const void *key) const;
+  int leaf_snprintf(size_t id, char *buf, size_t buflen, const void *leaf) const;
+  int key_sscanf(size_t id, const char *buf, void *key) const;
+  int leaf_sscanf(size_t id, const char *buf, void *leaf) const;
+
+ private:
+  explicit Module(std::shared_ptr<Artifact> artifact) : artifact_(artifact) {}
+  int relocate();
+  // fd of the map of previous to use for table, or -1
+  static int find_map(const Module *previous, const Artifact::Table &table);
+  std::shared_ptr<Artifact> artifact_;
+  std::vector<int> fds_;
+  // maps created (or duplicated) for this module, closed with it
+  std::vector<int> owned_fds_;
+  std::vector<std::vector<struct bpf_insn>> insns_;
+};
+
+// Compiled artifacts by hash of source text and compile flags, so that
+// loading the same source again skips the compiler. Bounded to a number of
+// artifacts, least recently used first out.
+class ModuleCache {
+ public:
+  explicit ModuleCache(size_t capacity);
+  void set_capacity(size_t capacity);
+  std::shared_ptr<Artifact> find(const std::string &text, unsigned flags);
+  void insert(std::shared_ptr<Artifact> artifact);
+  std::string stats() const;
+ private:
+  typedef std::list<std::shared_ptr<Artifact>> List;
+  mutable std::mutex mutex_;
+  size_t capacity_;
+  List lru_;
+  std::unordered_multimap<uint64_t, List::iterator> index_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+};
+
+// Walks the entries of a map, a batch at a time with BPF_MAP_LOOKUP_BATCH
+// where the kernel and map type support it, else one key at a time.
+class MapReader {
+ public:
+  // Without leaves, a walk one key at a time skips the lookups; batches
+  // always come with them.
+  MapReader(int fd, size_t key_size, size_t leaf_size, size_t batch_size,
+            bool leaves = true);
+  // Reads the next entries, returning how many there are (at most the
+  // batch size, unless a hash bucket holds more), 0 once the map is
+  // exhausted, or a negative errno.
+  int next();
+  // Continue with the entries after key, one key at a time, since batch
+  // positions can not be rebuilt from a key.
+  void seek(const uint8_t *key);
+  const uint8_t * key(size_t i) const { return &keys_[i * key_size_]; }
+  const uint8_t * leaf(size_t i) const { return &leaves_[i * leaf_size_]; }
+  // number of bpf syscalls made so far
+  size_t syscalls() const { return syscalls_; }
+ private:
+  int next_batch();
+  int next_key();
+  int fd_;
+  size_t key_size_;
+  size_t leaf_size_;
+  size_t batch_size_;
+  bool want_leaves_;
+  std::vector<uint8_t> keys_;
+  std::vector<uint8_t> leaves_;
+  // kernel's position between batches, or the last key seen
+  std::vector<uint8_t> cursor_;
+  bool batched_;
+  bool started_;
+  bool done_;
+  size_t syscalls_;
+};
+
+// Artifacts kept in a directory, so that a restarted daemon does not need
+// to compile again. Entries are named by the artifact key and by the libbcc
+// and kernel versions they were built for, carry a checksum and their full
+// source, and are written to a temporary file then renamed into place.
+// Least recently used entries go first once the directory is over size.
+class DiskCache {
+ public:
+  DiskCache();
+  // an empty dir disables the cache
+  int init(const std::string &dir, size_t max_bytes);
+  std::shared_ptr<Artifact> find(const std::string &text, unsigned flags);
+  void store(const Artifact &artifact);
+  std::string stats() const;
+ private:
+  std::string path(uint64_t key) const;
+  void evict();
+  std::string dir_;
+  size_t max_bytes_;
+  std::string build_;
+  uint64_t build_hash_;
+  mutable std::mutex mutex_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t errors_;
+  uint64_t evictions_;
+};
+
+}  // namespace bcc
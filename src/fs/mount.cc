@@ -15,8 +15,12 @@
  */
 
 #include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
-#include <fuse.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
 #include <string>
 #include <vector>
 
@@ -26,191 +30,532 @@
 namespace bcc {
 
 using std::find;
+using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 
-Mount::Mount() : flags_(0) {
+Mount *Mount::instance_ = nullptr;
+
+// Listing of one opendir, built as readdir asks for it. data holds the
+// entries from offset base on that have not been handed out yet.
+struct DirBuffer {
+  fuse_req_t req;
+  string data;
+  off_t base;
+  // fill_dir asks the directory to stop once data holds this much
+  size_t want;
+  bool done;
+  unique_ptr<FileHandle> cursor;
+};
+
+static int fill_dir(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  DirBuffer *b = static_cast<DirBuffer *>(buf);
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  if (stbuf)
+    st = *stbuf;
+  size_t len = fuse_add_direntry(b->req, nullptr, 0, name, nullptr, 0);
+  size_t pos = b->data.size();
+  b->data.resize(pos + len);
+  fuse_add_direntry(b->req, &b->data[pos], len, name, &st, b->base + pos + len);
+  return b->data.size() >= b->want;
+}
+
+#define TIMEOUT_OPT(t, cls, field) \
+  { t "=%lf", cls * sizeof(CacheTimeouts) + offsetof(CacheTimeouts, field), 0 }
+static const struct fuse_opt timeout_opts[] = {
+  TIMEOUT_OPT("struct_entry_timeout", Inode::cache_struct, entry),
+  TIMEOUT_OPT("struct_attr_timeout", Inode::cache_struct, attr),
+  TIMEOUT_OPT("struct_negative_timeout", Inode::cache_struct, negative),
+  TIMEOUT_OPT("map_entry_timeout", Inode::cache_map, entry),
+  TIMEOUT_OPT("map_attr_timeout", Inode::cache_map, attr),
+  TIMEOUT_OPT("map_negative_timeout", Inode::cache_map, negative),
+  TIMEOUT_OPT("value_entry_timeout", Inode::cache_value, entry),
+  TIMEOUT_OPT("value_attr_timeout", Inode::cache_value, attr),
+  FUSE_OPT_END
+};
+#undef TIMEOUT_OPT
+
+static const struct fuse_opt mount_opts[] = {
+  { "compile_threads=%u", offsetof(MountOptions, compile_threads), 0 },
+  { "module_cache=%u", offsetof(MountOptions, module_cache), 0 },
+  { "cache_dir=%s", offsetof(MountOptions, cache_dir), 0 },
+  { "cache_size=%u", offsetof(MountOptions, cache_size), 0 },
+  { "preserve_maps", offsetof(MountOptions, preserve_maps), 1 },
+  { "batch_size=%u", offsetof(MountOptions, batch_size), 0 },
+  { "refresh_min=%lf", offsetof(MountOptions, refresh_min), 0 },
+  { "refresh_max=%lf", offsetof(MountOptions, refresh_max), 0 },
+  { "value_ttl=%lf", offsetof(MountOptions, value_ttl), 0 },
+  { "map_entries=%u", offsetof(MountOptions, map_entries), 0 },
+  { "fd_backlog=%u", offsetof(MountOptions, fd_backlog), 0 },
+  { "control=%s", offsetof(MountOptions, control), 0 },
+  FUSE_OPT_END
+};
+
+Mount::Mount() : flags_(0), ch_(nullptr), modules_(0) {
+  instance_ = this;
   log_ = fopen("/tmp/bcc-fuse.log", "w");
-  oper_.reset(new fuse_operations);
-  root_.reset(new RootDir(0755));
+  // Program and function directories only change when source or type is
+  // rewritten, and those paths invalidate what they remove. Names that are
+  // added are not invalidated, so a nonzero negative timeout delays their
+  // appearance. Map contents change behind our back, so keep those short.
+  timeouts_[Inode::cache_struct] = CacheTimeouts{60.0, 60.0, 0.0};
+  timeouts_[Inode::cache_map] = CacheTimeouts{1.0, 1.0, 0.0};
+  timeouts_[Inode::cache_value] = CacheTimeouts{1.0, 0.0, 0.0};
+  opts_.compile_threads = std::max(1u, std::thread::hardware_concurrency());
+  opts_.module_cache = 64;
+  opts_.cache_dir = nullptr;
+  opts_.cache_size = 256;
+  opts_.preserve_maps = 0;
+  opts_.batch_size = 256;
+  opts_.refresh_min = 1.0;
+  opts_.refresh_max = 8.0;
+  opts_.value_ttl = 1.0;
+  opts_.map_entries = 4096;
+  opts_.fd_backlog = 128;
+  opts_.control = nullptr;
+  oper_.reset(new fuse_lowlevel_ops);
+  root_ = make_node<RootDir>(0755);
   root_->set_mount(this);
+  inodes_.lookup(root_);
+  root_->add_child(".config", make_node<InfoFile>([this] () { return config(); }));
+  root_->add_child(".stats", make_node<InfoFile>([this] () {
+    return modules_.stats() + disk_cache_.stats();
+  }));
   memset(&*oper_, 0, sizeof(*oper_));
+  oper_->lookup = lookup_;
+  oper_->forget = forget_;
   oper_->getattr = getattr_;
-  oper_->readdir = readdir_;
-  oper_->mkdir = mkdir_;
+  oper_->setattr = setattr_;
+  oper_->readlink = readlink_;
   oper_->mknod = mknod_;
-  oper_->create = create_;
+  oper_->mkdir = mkdir_;
   oper_->unlink = unlink_;
   oper_->open = open_;
   oper_->read = read_;
   oper_->write = write_;
-  oper_->truncate = truncate_;
   oper_->flush = flush_;
-  oper_->readlink = readlink_;
-  oper_->ioctl = ioctl_;
+  oper_->release = release_;
+  oper_->opendir = opendir_;
+  oper_->readdir = readdir_;
+  oper_->releasedir = releasedir_;
+  oper_->create = create_;
+  oper_->poll = poll_;
 }
 
 Mount::~Mount() {
+  root_.reset();
+  free(opts_.cache_dir);
   fclose(log_);
 }
 
-Mount * Mount::instance() {
-  return static_cast<Mount *>(fuse_get_context()->private_data);
+void Mount::reply_err(fuse_req_t req, int rc) {
+  if (rc)
+    fuse_reply_err(req, -rc);
+}
+
+shared_ptr<Dir> Mount::dir(fuse_ino_t ino) const {
+  return std::dynamic_pointer_cast<Dir>(node(ino));
 }
 
-int Mount::getattr(const char *path, struct stat *st) {
-  log("getattr: %s\n", path);
-  memset(st, 0, sizeof(*st));
+shared_ptr<Inode> Mount::resolve(const char *path) const {
   Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  if (!leaf || p.next())
+  auto leaf = root_->leaf(&p);
+  // leaf() stops at the last node found
+  if (p.next())
+    return nullptr;
+  return leaf;
+}
+
+int Mount::entry(const shared_ptr<Inode> &node, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  if (int rc = node->getattr(&e->attr))
+    return rc;
+  e->ino = node->ino();
+  e->generation = inodes_.generation(e->ino);
+  e->attr.st_ino = e->ino;
+  e->attr_timeout = timeouts(node->cache_class()).attr;
+  e->entry_timeout = timeouts(node->cache_class()).entry;
+  inodes_.lookup(node);
+  return 0;
+}
+
+int Mount::reply_entry(fuse_req_t req, const shared_ptr<Inode> &node) {
+  struct fuse_entry_param e;
+  if (!node)
     return -ENOENT;
-  return leaf->getattr(st);
+  if (int rc = entry(node, &e))
+    return rc;
+  fuse_reply_entry(req, &e);
+  return 0;
+}
+
+int Mount::lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  log("lookup: %lu %s\n", parent, name);
+  auto d = dir(parent);
+  if (!d)
+    return node(parent) ? -ENOTDIR : -ENOENT;
+  auto leaf = d->lookup(name);
+  if (!leaf && timeouts(d->cache_class()).negative > 0) {
+    // an entry with ino 0 lets the kernel cache the miss
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = timeouts(d->cache_class()).negative;
+    fuse_reply_entry(req, &e);
+    return 0;
+  }
+  return reply_entry(req, leaf);
 }
 
-int Mount::readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+void Mount::forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  inodes_.forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+int Mount::getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  log("getattr: %lu\n", ino);
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  auto leaf = node(ino);
+  if (!leaf)
+    return -ENOENT;
+  if (int rc = leaf->getattr(&st))
+    return rc;
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, timeouts(leaf->cache_class()).attr);
+  return 0;
+}
+
+int Mount::setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
                    struct fuse_file_info *fi) {
-  log("readdir: %s\n", path);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  if (!leaf || p.next())
+  log("setattr: %lu sz=%zd\n", ino, attr->st_size);
+  auto leaf = node(ino);
+  if (!leaf)
     return -ENOENT;
-  if (Dir *dir = dynamic_cast<Dir *>(leaf))
-    return dir->readdir(buf, filler, offset, fi);
-  return -EBADF;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    File *file = dynamic_cast<File *>(leaf.get());
+    if (!file)
+      return -EISDIR;
+    if (int rc = file->truncate(attr->st_size))
+      return rc;
+  }
+  return getattr(req, ino, fi);
 }
 
-int Mount::mkdir(const char *path, mode_t mode) {
-  log("mkdir: %s\n", path);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  p.consume();
-  if (!p.cur())
-    return -EEXIST;
-  if (p.next())
+int Mount::readlink(fuse_req_t req, fuse_ino_t ino) {
+  log("readlink: %lu\n", ino);
+  auto leaf = node(ino);
+  if (!leaf)
     return -ENOENT;
-  if (Dir *dir = dynamic_cast<Dir *>(leaf))
-    return dir->mkdir(p.cur(), mode);
-  return -ENOTDIR;
+  Link *link = dynamic_cast<Link *>(leaf.get());
+  if (!link)
+    return -EINVAL;
+  char buf[PATH_MAX + 1];
+  if (int rc = link->readlink(buf, sizeof(buf) - 1))
+    return rc;
+  buf[PATH_MAX] = 0;
+  fuse_reply_readlink(req, buf);
+  return 0;
 }
 
-int Mount::mknod(const char *path, mode_t mode, dev_t rdev) {
-  log("mknod: %s %#x %#x\n", path, mode, rdev);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  // special case hack for binding on top of myself
-  if (FDSocket *fd_sock = dynamic_cast<FDSocket *>(leaf))
-    return fd_sock->mknod();
-  p.consume();
-  if (!p.cur())
+int Mount::mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+  log("mknod: %lu %s %#x %#x\n", parent, name, mode, rdev);
+  auto d = dir(parent);
+  if (!d)
+    return node(parent) ? -ENOTDIR : -ENOENT;
+  if (d->lookup(name))
     return -EEXIST;
-  if (p.next())
-    return -ENOENT;
-  if (Dir *dir = dynamic_cast<Dir *>(leaf))
-    return dir->mknod(p.cur(), mode, rdev);
-  return -ENOTDIR;
+  if (int rc = d->mknod(name, mode, rdev))
+    return rc;
+  return reply_entry(req, d->lookup(name));
 }
 
-int Mount::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-  log("create: %s\n", path);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  p.consume();
-  if (!p.cur())
+int Mount::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  log("mkdir: %lu %s\n", parent, name);
+  auto d = dir(parent);
+  if (!d)
+    return node(parent) ? -ENOTDIR : -ENOENT;
+  if (d->lookup(name))
     return -EEXIST;
-  if (p.next())
+  if (int rc = d->mkdir(name, mode))
+    return rc;
+  return reply_entry(req, d->lookup(name));
+}
+
+int Mount::create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                  struct fuse_file_info *fi) {
+  log("create: %lu %s\n", parent, name);
+  auto d = dir(parent);
+  if (!d)
+    return node(parent) ? -ENOTDIR : -ENOENT;
+  if (d->lookup(name))
+    return -EEXIST;
+  if (int rc = d->create(name, mode, fi))
+    return rc;
+  // a map entry that is not written yet may be dropped again by a refresh
+  auto leaf = d->lookup(name);
+  if (!leaf)
     return -ENOENT;
-  if (Dir *dir = dynamic_cast<Dir *>(leaf))
-    return dir->create(p.cur(), mode, fi);
-  return -ENOTDIR;
+  if (File *file = dynamic_cast<File *>(leaf.get())) {
+    if (int rc = file->open(fi))
+      return rc;
+  }
+  struct fuse_entry_param e;
+  if (int rc = entry(leaf, &e))
+    return rc;
+  fuse_reply_create(req, &e, fi);
+  return 0;
 }
 
-int Mount::unlink(const char *path) {
-  log("unlink: %s\n", path);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  if (!leaf || p.next())
+int Mount::unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  log("unlink: %lu %s\n", parent, name);
+  auto d = dir(parent);
+  if (!d || !d->lookup(name))
     return -ENOENT;
-  if (Dir *dir = dynamic_cast<MapDir *>(leaf->parent()))
-    return dir->unlink(p.cur());
-  return -EPERM;
+  if (!dynamic_cast<MapDir *>(d.get()))
+    return -EPERM;
+  if (int rc = d->unlink(name))
+    return rc;
+  fuse_reply_err(req, 0);
+  return 0;
 }
 
-int Mount::open(const char *path, struct fuse_file_info *fi) {
-  log("open: %s\n", path);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  if (!leaf || p.next())
+int Mount::open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  log("open: %lu\n", ino);
+  auto leaf = node(ino);
+  if (!leaf)
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->open(fi);
-  return -EISDIR;
+  File *file = dynamic_cast<File *>(leaf.get());
+  if (!file)
+    return -EISDIR;
+  if (int rc = file->open(fi))
+    return rc;
+  fuse_reply_open(req, fi);
+  return 0;
 }
 
-int Mount::read(const char *path, char *buf, size_t size, off_t offset,
+int Mount::read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
                 struct fuse_file_info *fi) {
-  log("read: %s sz=%zu off=%zu\n", path, size, offset);
-  Inode *leaf = (Inode *)fi->fh;
-  if (!leaf)
+  log("read: %lu sz=%zu off=%zu\n", ino, size, offset);
+  auto file = std::dynamic_pointer_cast<File>(node(ino));
+  if (!file)
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->read(buf, size, offset, fi);
-  return -EISDIR;
+  // A blocking read of a job status is answered once the job is done,
+  // without holding up this thread in the meantime.
+  auto status = std::dynamic_pointer_cast<StatusFile>(file);
+  if (status && offset == 0 && !(fi->flags & O_NONBLOCK)) {
+    status->wait([req, size] (const string &data) {
+      fuse_reply_buf(req, data.data(), std::min(size, data.size()));
+    });
+    return 0;
+  }
+  unique_ptr<char[]> buf(new char[size]);
+  int rc = file->read(&buf[0], size, offset, fi);
+  if (rc < 0)
+    return rc;
+  fuse_reply_buf(req, &buf[0], rc);
+  return 0;
 }
 
-int Mount::write(const char *path, const char *buf, size_t size, off_t offset,
+int Mount::write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
                  struct fuse_file_info *fi) {
-  log("write: %s sz=%zu off=%zu\n", path, size, offset);
-  Inode *leaf = (Inode *)fi->fh;
-  if (!leaf)
+  log("write: %lu sz=%zu off=%zu\n", ino, size, offset);
+  auto file = std::dynamic_pointer_cast<File>(node(ino));
+  if (!file)
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->write(buf, size, offset, fi);
-  return -EISDIR;
+  int rc = file->write(buf, size, offset, fi);
+  if (rc < 0)
+    return rc;
+  fuse_reply_write(req, rc);
+  return 0;
 }
 
-int Mount::truncate(const char *path, off_t newsize) {
-  log("truncate: %s sz=%zd\n", path, newsize);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  if (!leaf || p.next())
+int Mount::flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  log("flush: %lu\n", ino);
+  auto file = std::dynamic_pointer_cast<File>(node(ino));
+  if (!file)
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->truncate(newsize);
-  return -EISDIR;
+  if (int rc = file->flush(fi))
+    return rc;
+  fuse_reply_err(req, 0);
+  return 0;
 }
 
-int Mount::flush(const char *path, struct fuse_file_info *fi) {
-  log("flush: %s\n", path);
-  Inode *leaf = (Inode *)fi->fh;
-  if (!leaf)
-    return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->flush(fi);
-  return -EISDIR;
+int Mount::release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  log("release: %lu\n", ino);
+  delete (FileHandle *)fi->fh;
+  fuse_reply_err(req, 0);
+  return 0;
 }
 
-int Mount::readlink(const char *path, char *buf, size_t size) {
-  log("readlink: %s\n", path);
-  Path p(path);
-  Inode *leaf = root_->leaf(&p);
-  if (!leaf || p.next())
+int Mount::opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  log("opendir: %lu\n", ino);
+  auto d = dir(ino);
+  if (!d)
+    return node(ino) ? -ENOTDIR : -ENOENT;
+  // The listing is built once per open handle, so that a reader walking a
+  // large directory in several readdir calls does not rebuild it each time,
+  // and only as far as it is read, so that it need not be held all at once.
+  unique_ptr<DirBuffer> b(new DirBuffer);
+  b->base = 0;
+  b->want = 0;
+  b->done = false;
+  fi->fh = (uintptr_t)b.release();
+  fuse_reply_open(req, fi);
+  return 0;
+}
+
+int Mount::readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+  log("readdir: %lu sz=%zu off=%zu\n", ino, size, offset);
+  DirBuffer *b = (DirBuffer *)fi->fh;
+  if (!b)
+    return -EBADF;
+  auto d = dir(ino);
+  if (!d)
     return -ENOENT;
-  if (Link *link = dynamic_cast<Link *>(leaf))
-    return link->readlink(buf, size);
-  return -EINVAL;
+  if (offset < b->base) {
+    // rewound, list again from the start
+    b->data.clear();
+    b->base = 0;
+    b->done = false;
+    b->cursor.reset();
+  }
+  b->req = req;
+  for (;;) {
+    // what comes before offset has been handed out
+    size_t skip = std::min((size_t)(offset - b->base), b->data.size());
+    b->data.erase(0, skip);
+    b->base += skip;
+    if (b->done || b->base + (off_t)b->data.size() >= offset + (off_t)size)
+      break;
+    b->want = offset + size - b->base;
+    int rc = d->readdir_part(b, fill_dir, &b->cursor);
+    if (rc < 0)
+      return rc;
+    b->done = rc == 0;
+  }
+  size_t start = offset - b->base;
+  if (start < b->data.size())
+    fuse_reply_buf(req, b->data.data() + start, std::min(size, b->data.size() - start));
+  else
+    fuse_reply_buf(req, nullptr, 0);
+  return 0;
 }
 
+int Mount::releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  delete (DirBuffer *)fi->fh;
+  fuse_reply_err(req, 0);
+  return 0;
+}
 
-int Mount::ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
-                 unsigned int flags, void *data) {
-  log("ioctl: %s\n", path);
+int Mount::poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                struct fuse_pollhandle *ph) {
+  log("poll: %lu\n", ino);
+  std::function<void()> notify;
+  if (ph) {
+    shared_ptr<struct fuse_pollhandle> handle(ph, fuse_pollhandle_destroy);
+    notify = [handle] () { fuse_lowlevel_notify_poll(handle.get()); };
+  }
+  auto file = std::dynamic_pointer_cast<File>(node(ino));
+  if (!file)
+    return -ENOENT;
+  fuse_reply_poll(req, file->poll(std::move(notify)));
   return 0;
 }
 
+void Mount::invalidate_inode(Inode *node) {
+  if (!ch_ || timeouts(node->cache_class()).attr <= 0)
+    return;
+  fuse_lowlevel_notify_inval_inode(ch_, node->ino(), 0, 0);
+}
+
+void Mount::invalidate_entry(Dir *parent, const string &name) {
+  if (!ch_ || timeouts(parent->cache_class()).entry <= 0)
+    return;
+  fuse_lowlevel_notify_inval_entry(ch_, parent->ino(), name.data(), name.size());
+}
+
+string Mount::config() const {
+  static const char *names[] = {"struct", "map", "value"};
+  string s;
+  char buf[128];
+  for (int i = Inode::cache_struct; i <= Inode::cache_value; ++i) {
+    snprintf(buf, sizeof(buf), "%s_entry_timeout=%g\n%s_attr_timeout=%g\n",
+             names[i], timeouts_[i].entry, names[i], timeouts_[i].attr);
+    s += buf;
+    if (i != Inode::cache_value) {
+      snprintf(buf, sizeof(buf), "%s_negative_timeout=%g\n", names[i], timeouts_[i].negative);
+      s += buf;
+    }
+  }
+  snprintf(buf, sizeof(buf), "compile_threads=%u\nmodule_cache=%u\n",
+           opts_.compile_threads, opts_.module_cache);
+  s += buf;
+  s += string("cache_dir=") + (opts_.cache_dir ? opts_.cache_dir : "") + "\n";
+  snprintf(buf, sizeof(buf), "cache_size=%u\npreserve_maps=%d\nbatch_size=%u\n",
+           opts_.cache_size, opts_.preserve_maps, opts_.batch_size);
+  s += buf;
+  snprintf(buf, sizeof(buf), "refresh_min=%g\nrefresh_max=%g\nvalue_ttl=%g\nmap_entries=%u\n",
+           opts_.refresh_min, opts_.refresh_max, opts_.value_ttl, opts_.map_entries);
+  s += buf;
+  snprintf(buf, sizeof(buf), "fd_backlog=%u\n", opts_.fd_backlog);
+  s += buf;
+  s += string("control=") + (opts_.control ? opts_.control : "") + "\n";
+  return s;
+}
+
 int Mount::run(int argc, char **argv) {
-  mountpath_.assign(argv[argc - 1]);
-  return fuse_main(argc, argv, &*oper_, this);
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint = nullptr;
+  int multithreaded = 0, foreground = 0;
+  int rc = 1;
+  if (fuse_opt_parse(&args, timeouts_, timeout_opts, nullptr) < 0 ||
+      fuse_opt_parse(&args, &opts_, mount_opts, nullptr) < 0 ||
+      fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) < 0 || !mountpoint) {
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+  mountpath_.assign(mountpoint);
+  modules_.set_capacity(opts_.module_cache);
+  if (opts_.refresh_min <= 0)
+    opts_.refresh_min = 1.0;
+  opts_.refresh_max = std::max(opts_.refresh_max, opts_.refresh_min);
+  opts_.map_entries = std::max(opts_.map_entries, 1u);
+  if (opts_.cache_dir) {
+    if (int err = disk_cache_.init(opts_.cache_dir, (size_t)opts_.cache_size << 20))
+      fprintf(stderr, "cache_dir %s: %s, not caching on disk\n", opts_.cache_dir, strerror(-err));
+  }
+  if (struct fuse_chan *ch = fuse_mount(mountpoint, &args)) {
+    if (struct fuse_session *se = fuse_lowlevel_new(&args, &*oper_, sizeof(*oper_), this)) {
+      if (fuse_set_signal_handlers(se) == 0) {
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+        ch_ = ch;
+        // threads do not survive daemonizing, start them only now
+        compiler_.start(opts_.compile_threads);
+        refresher_.start();
+        if (int err = fd_server_.start(opts_.fd_backlog, opts_.control ? opts_.control : ""))
+          fprintf(stderr, "fd server: %s\n", strerror(-err));
+        else
+          root_->add_child(FdServer::control_name,
+                           make_node<Link>(0444, fd_server_.control_path()));
+        rc = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        fd_server_.stop();
+        refresher_.stop();
+        compiler_.stop();
+        ch_ = nullptr;
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+  fuse_opt_free_args(&args);
+  return rc ? 1 : 0;
 }
 
 }  // namespace bcc
@@ -16,18 +16,39 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
-// forward declarations from fuse.h
+#include "module.h"
+#include "rwlock.h"
+#include "slab.h"
+
+// forward declarations from fuse_lowlevel.h
 extern "C" {
-struct fuse_operations;
+struct fuse_lowlevel_ops;
 struct fuse_file_info;
+struct fuse_entry_param;
+struct fuse_req;
+typedef struct fuse_req *fuse_req_t;
+typedef unsigned long fuse_ino_t;
+struct fuse_chan;
+struct fuse_pollhandle;
 }
 
 namespace bcc {
@@ -36,89 +57,316 @@ class Mount;
 class Inode;
 class Dir;
 class File;
+class MapEntry;
+class MapRawEntry;
+class FileHandle;
 class Path;
 
 typedef int (*fuse_fill_dir_t) (void *buf, const char *name,
         const struct stat *stbuf, off_t off);
+
+// How long the kernel may cache a lookup of, and the attributes of, a node.
+// The negative timeout belongs to a directory and covers names it does not
+// contain.
+struct CacheTimeouts {
+  double entry;
+  double attr;
+  double negative;
+};
+
+// Maps the node ids handed out to the kernel onto Inode objects. A slot is
+// only recycled once the node is gone and the kernel has forgotten every
+// reference to it, and each reuse bumps the slot generation so that an
+// (ino, generation) pair never refers to two different nodes.
+// Nodes are reserved a slot when constructed, and become reachable through
+// get() once handed to the kernel with lookup().
+class InodeTable {
+ public:
+  InodeTable();
+  fuse_ino_t add();
+  void remove(fuse_ino_t ino);
+  std::shared_ptr<Inode> get(fuse_ino_t ino) const;
+  uint64_t generation(fuse_ino_t ino) const;
+  // account for an entry reply / forget from the kernel
+  void lookup(const std::shared_ptr<Inode> &node);
+  void forget(fuse_ino_t ino, uint64_t nlookup);
+ private:
+  struct Slot {
+    std::weak_ptr<Inode> node;
+    bool live;
+    uint64_t generation;
+    uint64_t nlookup;
+  };
+  void release(fuse_ino_t ino);
+  mutable std::mutex mutex_;
+  std::vector<Slot> slots_;
+  std::vector<fuse_ino_t> free_;
+};
+
+// Options given with -o that are not cache timeouts
+struct MountOptions {
+  unsigned compile_threads;
+  unsigned module_cache;
+  char *cache_dir;
+  unsigned cache_size;
+  int preserve_maps;
+  unsigned batch_size;
+  // bounds, in seconds, for how often a map directory is refreshed
+  double refresh_min;
+  double refresh_max;
+  // seconds a value fetched while listing a map directory stays good for
+  double value_ttl;
+  // entries kept per map directory, besides those that are open
+  unsigned map_entries;
+  // accept backlog of the control socket
+  unsigned fd_backlog;
+  // where to bind the control socket, in a directory of its own if unset
+  char *control;
+};
+
+// Fixed set of threads running queued jobs in submission order
+class WorkerPool {
+ public:
+  WorkerPool();
+  ~WorkerPool();
+  void start(size_t nthreads);
+  // drops queued jobs and waits for running ones
+  void stop();
+  // returns false if there are no threads to run fn
+  bool submit(std::function<void()> fn);
+ private:
+  void run();
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> jobs_;
+  std::vector<std::thread> threads_;
+  bool stop_;
+};
+
+class MapDir;
+
+// Thread that keeps map directories in line with their maps, each on its
+// own schedule, so that requests never wait for a map walk
+class Refresher {
+ public:
+  Refresher();
+  ~Refresher();
+  void start();
+  void stop();
+  // Refresh dir once delay seconds have passed, for as long as it lives
+  // and gen is its current schedule.
+  void schedule(std::weak_ptr<MapDir> dir, double delay, uint64_t gen);
+  // have dir let go of evicted entries, soon
+  void flush(std::weak_ptr<Dir> dir);
+ private:
+  void run();
+  struct Job {
+    std::chrono::steady_clock::time_point due;
+    // a MapDir, unless gen is 0
+    std::weak_ptr<Dir> dir;
+    uint64_t gen;
+    bool operator>(const Job &other) const { return due > other.due; }
+  };
+  void push(Job job);
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::priority_queue<Job, std::vector<Job>, std::greater<Job>> jobs_;
+  std::thread thread_;
+  bool stop_;
+};
+
+// Thread serving the control socket, which hands out the fds of maps and
+// functions by their path in the tree, see bcc_recv_fds(). The socket is
+// bound outside the mount, and the mount root links to it. Connections stay
+// open for further requests, which may be sent before the replies to
+// earlier ones are read.
+class FdServer {
+ public:
+  static constexpr const char *control_name = ".control";
+  FdServer();
+  ~FdServer();
+  // Binds the control socket at path, or in a new directory if path is
+  // empty, and serves it.
+  int start(int backlog, const std::string &path);
+  void stop();
+  // where the control socket is bound, once started
+  std::string control_path();
+ private:
+  // One reply message, with the fds it carries and whatever keeps them
+  // open until sent
+  struct Message {
+    Message() : sent(0) {}
+    std::vector<int32_t> status;
+    std::vector<int> fds;
+    std::vector<std::shared_ptr<const void>> hold;
+    // bytes of status sent so far
+    size_t sent;
+  };
+  struct Conn {
+    Conn() : eof(false), writing(false) {}
+    // requests not yet answered
+    std::string in;
+    std::deque<Message> out;
+    bool eof;
+    // waiting to write out, and not reading meanwhile
+    bool writing;
+  };
+  void run();
+  void wake();
+  int watch(int sock, uint32_t events, int op);
+  int bind_control(const std::string &path, int backlog);
+  void accept_control();
+  void read_control(int conn);
+  void write_control(int conn);
+  // handles the requests read so far, for as long as replies go out
+  void process_control(int conn);
+  void reply_control(Conn &c, const std::vector<std::string> &paths);
+  // sends what it can of the queued replies, false if the connection broke
+  bool flush_control(int conn);
+  void close_control(int conn);
+  // connections are dropped once their unanswered requests pass this size
+  static const size_t max_request = 1 << 20;
+  std::mutex mutex_;
+  int epoll_fd_;
+  int wake_fd_;
+  std::thread thread_;
+  // the socket's path, and the directory made for it if any
+  std::string path_;
+  std::string dir_;
+  // the listening socket and its connections; only used by the server
+  // thread
+  int control_;
+  std::unordered_map<int, Conn> conns_;
+  bool stop_;
+};
+
 class Mount {
  private:
 
   // wrapper functions, to be registered with fuse
-  static int getattr_(const char *path, struct stat *st) {
-    return instance()->getattr(path, st);
+  static void lookup_(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    reply_err(req, instance()->lookup(req, parent, name));
   }
-  static int readdir_(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-                      struct fuse_file_info *fi) {
-    return instance()->readdir(path, buf, filler, offset, fi);
+  static void forget_(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    instance()->forget(req, ino, nlookup);
   }
-  static int mkdir_(const char *path, mode_t mode) {
-    return instance()->mkdir(path, mode);
+  static void getattr_(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    reply_err(req, instance()->getattr(req, ino, fi));
   }
-  static int mknod_(const char *path, mode_t mode, dev_t rdev) {
-    return instance()->mknod(path, mode, rdev);
+  static void setattr_(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                       struct fuse_file_info *fi) {
+    reply_err(req, instance()->setattr(req, ino, attr, to_set, fi));
   }
-  static int create_(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    return instance()->create(path, mode, fi);
+  static void readlink_(fuse_req_t req, fuse_ino_t ino) {
+    reply_err(req, instance()->readlink(req, ino));
   }
-  static int unlink_(const char *path) {
-    return instance()->unlink(path);
+  static void mknod_(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                     dev_t rdev) {
+    reply_err(req, instance()->mknod(req, parent, name, mode, rdev));
   }
-  static int open_(const char *path, struct fuse_file_info *fi) {
-    return instance()->open(path, fi);
+  static void mkdir_(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    reply_err(req, instance()->mkdir(req, parent, name, mode));
   }
-  static int read_(const char *path, char *buf, size_t size, off_t offset,
-                   struct fuse_file_info *fi) {
-    return instance()->read(path, buf, size, offset, fi);
+  static void unlink_(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    reply_err(req, instance()->unlink(req, parent, name));
   }
-  static int write_(const char *path, const char *buf, size_t size, off_t offset,
+  static void open_(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    reply_err(req, instance()->open(req, ino, fi));
+  }
+  static void read_(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
                     struct fuse_file_info *fi) {
-    return instance()->write(path, buf, size, offset, fi);
+    reply_err(req, instance()->read(req, ino, size, offset, fi));
+  }
+  static void write_(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *fi) {
+    reply_err(req, instance()->write(req, ino, buf, size, offset, fi));
+  }
+  static void flush_(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    reply_err(req, instance()->flush(req, ino, fi));
+  }
+  static void opendir_(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    reply_err(req, instance()->opendir(req, ino, fi));
+  }
+  static void readdir_(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    reply_err(req, instance()->readdir(req, ino, size, offset, fi));
   }
-  static int truncate_(const char *path, off_t newsize) {
-    return instance()->truncate(path, newsize);
+  static void releasedir_(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    reply_err(req, instance()->releasedir(req, ino, fi));
   }
-  static int flush_(const char *path, struct fuse_file_info *fi) {
-    return instance()->flush(path, fi);
+  static void create_(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                      struct fuse_file_info *fi) {
+    reply_err(req, instance()->create(req, parent, name, mode, fi));
   }
-  static int readlink_(const char *path, char *buf, size_t size) {
-    return instance()->readlink(path, buf, size);
+  static void release_(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    reply_err(req, instance()->release(req, ino, fi));
   }
-  static int ioctl_(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
-                    unsigned int flags, void *data) {
-    return instance()->ioctl(path, cmd, arg, fi, flags, data);
+  static void poll_(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                    struct fuse_pollhandle *ph) {
+    reply_err(req, instance()->poll(req, ino, fi, ph));
   }
 
   // implementations of fuse callbacks
-  int getattr(const char *path, struct stat *st);
-  int readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+  // Each returns 0 once it has sent its own reply, or a negative errno to
+  // be sent back by the wrapper.
+  int lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+  void forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+  int getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+  int setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
               struct fuse_file_info *fi);
-  int mkdir(const char *path, mode_t mode);
-  int mknod(const char *path, mode_t mode, dev_t rdev);
-  int mknod(const char *path, mode_t mode, struct fuse_file_info *fi);
-  int create(const char *path, mode_t mode, struct fuse_file_info *fi);
-  int unlink(const char *path);
-  int open(const char *path, struct fuse_file_info *fi);
-  int read(const char *path, char *buf, size_t size, off_t offset,
+  int readlink(fuse_req_t req, fuse_ino_t ino);
+  int mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+  int mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+  int unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+  int open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+  int read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
            struct fuse_file_info *fi);
-  int write(const char *path, const char *buf, size_t size, off_t offset,
+  int write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi);
-  int flush(const char *path, struct fuse_file_info *fi);
-  int truncate(const char *path, off_t newsize);
-  int readlink(const char *path, char *buf, size_t size);
-  int ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
-            unsigned int flags, void *data);
+  int flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+  int release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+  int opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+  int readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+              struct fuse_file_info *fi);
+  int releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+  int create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+             struct fuse_file_info *fi);
+  int poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+           struct fuse_pollhandle *ph);
+
+  static void reply_err(fuse_req_t req, int rc);
+  // fill in an entry for node and take a kernel reference on it
+  int entry(const std::shared_ptr<Inode> &node, struct fuse_entry_param *e);
+  int reply_entry(fuse_req_t req, const std::shared_ptr<Inode> &node);
+  std::shared_ptr<Inode> node(fuse_ino_t ino) const { return inodes_.get(ino); }
+  std::shared_ptr<Dir> dir(fuse_ino_t ino) const;
+  std::string config() const;
 
  public:
   Mount();
   ~Mount();
   int run(int argc, char **argv);
 
-  // fetch this from fuse private_data
-  static Mount * instance();
+  static Mount * instance() { return instance_; }
 
   unsigned flags() const { return flags_; }
 
   const std::string & mountpath() const { return mountpath_; }
+  // node at path, relative to the mount root, or nullptr
+  std::shared_ptr<Inode> resolve(const char *path) const;
+  InodeTable & inodes() { return inodes_; }
+  const CacheTimeouts & timeouts(int cache_class) const { return timeouts_[cache_class]; }
+  const MountOptions & options() const { return opts_; }
+  WorkerPool & compiler() { return compiler_; }
+  Refresher & refresher() { return refresher_; }
+  ModuleCache & modules() { return modules_; }
+  DiskCache & disk_cache() { return disk_cache_; }
+
+  // Drop what the kernel has cached for a node, or for a name that was
+  // removed from a directory. Only safe outside of a request on that same
+  // node (or directory).
+  void invalidate_inode(Inode *node);
+  void invalidate_entry(Dir *parent, const std::string &name);
 
   template <typename... Args>
   void log(const char *fmt, Args&&... args) {
@@ -127,34 +375,56 @@ class Mount {
   }
 
  private:
-  std::unique_ptr<struct fuse_operations> oper_;
-  std::map<std::string, void *> modules_;
+  static Mount *instance_;
+  std::unique_ptr<struct fuse_lowlevel_ops> oper_;
   static std::vector<std::string> props_;
   static std::vector<std::string> subdirs_;
   FILE *log_;
-  std::unique_ptr<Dir> root_;
+  InodeTable inodes_;
+  std::shared_ptr<Dir> root_;
   unsigned flags_;
   std::string mountpath_;
+  struct fuse_chan *ch_;
+  CacheTimeouts timeouts_[3];
+  MountOptions opts_;
+  WorkerPool compiler_;
+  Refresher refresher_;
+  FdServer fd_server_;
+  ModuleCache modules_;
+  DiskCache disk_cache_;
 };
 
 // Inode base class
-class Inode {
+// Nodes are reference counted, so that a request can keep using one while
+// another thread removes it from the tree. Create them with make_node().
+class Inode : public std::enable_shared_from_this<Inode> {
  public:
   enum InodeType {
     dir_e, file_e, link_e, socket_e,
   };
+  // kernel caching policy, see Mount::timeouts()
+  enum CacheClass {
+    cache_struct, cache_map, cache_value,
+  };
   Inode(InodeType type, mode_t mode = 0644);
-  virtual ~Inode() {}
+  virtual ~Inode();
   Inode(const Inode &) = delete;
+  fuse_ino_t ino() const { return ino_; }
   mode_t mode() const { return mode_; }
   InodeType type() const { return type_; }
   void set_type(InodeType type) { type_ = type; }
-  Dir *parent() const { return parent_; }
-  void set_parent(Dir *parent) { parent_ = parent; }
+  // The parent is set once, when the node is first added to a directory and
+  // before any other thread can reach it, so it may be read without locks.
+  std::shared_ptr<Dir> parent() const { return parent_.lock(); }
+  void set_parent(const std::shared_ptr<Dir> &parent) { parent_ = parent; }
   void set_mount(Mount *mount) { mount_ = mount; }
   std::string path() const;
 
-  virtual Inode * leaf(Path *path) { return this; }
+  // second stage of construction, once shared_from_this() is usable
+  virtual void init() {}
+
+  virtual std::shared_ptr<Inode> leaf(Path *path) { return shared_from_this(); }
+  virtual CacheClass cache_class() const { return cache_struct; }
 
   virtual int getattr(struct stat *st) = 0;
   virtual int unlink() { return 0; }
@@ -166,11 +436,27 @@ class Inode {
 
  protected:
   Mount *mount_;
-  Dir *parent_;
+  std::weak_ptr<Dir> parent_;
+  fuse_ino_t ino_;
   InodeType type_;
   mode_t mode_;
 };
 
+template <class T, class... Args>
+std::shared_ptr<T> make_node(Args &&... args) {
+  auto node = std::make_shared<T>(std::forward<Args>(args)...);
+  node->init();
+  return node;
+}
+
+// make_node() with the node carved out by alloc, see slab.h
+template <class T, class Alloc, class... Args>
+std::shared_ptr<T> allocate_node(const Alloc &alloc, Args &&... args) {
+  auto node = std::allocate_shared<T>(alloc, std::forward<Args>(args)...);
+  node->init();
+  return node;
+}
+
 class Link : public Inode {
  public:
   Link(mode_t mode, const std::string &dst);
@@ -188,34 +474,39 @@ class Socket : public Inode {
   dev_t rdev_;
 };
 
-class FDSocket : public Socket {
- public:
-  FDSocket(mode_t mode, dev_t rdev, int fd);
-  ~FDSocket();
-  int getattr(struct stat *st) override;
-  int mknod();
- private:
-  int fd_;
-  int sock_;
-  std::thread thread_;
-  bool ready_;
-};
-
+// Directories guard their children with a reader/writer lock. Nodes
+// removed from children_ are released only after the lock is dropped, since
+// their destructors may call back into the tree.
 class Dir : public Inode {
  public:
+  typedef std::map<std::string, std::shared_ptr<Inode>> Children;
   Dir(mode_t mode);
-  Inode * leaf(Path *path) override;
-  void add_child(const std::string &name, std::unique_ptr<Inode> node);
+  std::shared_ptr<Inode> leaf(Path *path) override;
+  virtual std::shared_ptr<Inode> lookup(const char *name);
+  void add_child(const std::string &name, std::shared_ptr<Inode> node);
   void remove_child(const std::string &name);
   int getattr(struct stat *st) override;
   virtual int readdir(void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+  // Adds entries from *cursor on (from the start if there is none yet) until
+  // filler returns nonzero, and returns 1 while there are more. Directories
+  // too large to list at once override this; by default all of readdir()
+  // is added in one go.
+  virtual int readdir_part(void *buf, fuse_fill_dir_t filler, std::unique_ptr<FileHandle> *cursor);
   virtual int mkdir(const char *name, mode_t mode) { return -EACCES; }
   virtual int mknod(const char *name, mode_t mode, dev_t rdev);
   virtual int create(const char *name, mode_t mode, struct fuse_file_info *fi) { return -ENOTSUP; }
   virtual int unlink(const char *name);
+  // Called by the refresher, to let go of evicted entries.
+  virtual void flush_evicted() {}
   std::string path(const Inode *node) const;
  protected:
-  std::map<std::string, std::unique_ptr<Inode>> children_;
+  void invalidate(const std::string &name) { mount_->invalidate_entry(this, name); }
+  // callers of these hold lock_ for writing
+  std::shared_ptr<Inode> insert_child(const std::string &name, std::shared_ptr<Inode> node);
+  std::shared_ptr<Inode> erase_child(const std::string &name);
+  std::shared_ptr<Inode> erase_child(Children::iterator it);
+  mutable RWLock lock_;
+  Children children_;
   size_t n_files_;
   size_t n_dirs_;
 };
@@ -230,37 +521,138 @@ class ProgramDir : public Dir {
  public:
   ProgramDir(mode_t mode);
   ~ProgramDir();
-  int load(const char *text);
+  void init() override;
+  // Compile text on the compiler pool, or right away if it has no threads.
+  // Returns nonzero only for a failed synchronous compile.
+  int load(const std::string &text);
   void unload();
  private:
-  void *bpf_module_;
+  uint64_t begin_load(const std::string &text);
+  int finish_load(uint64_t seq, std::shared_ptr<Artifact> artifact);
+  void unload_locked();
+  void set_state(const char *valid, const char *status, bool pending = false);
+  // serializes load and unload
+  std::mutex mutex_;
+  std::shared_ptr<Module> module_;
+  // bumped by each load, so that only the newest compile is installed
+  uint64_t seq_;
+  // source of the loaded or pending module
+  std::string text_;
 };
 
 class MapDir : public Dir {
  public:
-  MapDir(mode_t mode, void *bpf_module_, int id);
-  int getattr(struct stat *st) override;
-  int readdir(void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) override;
+  MapDir(mode_t mode, std::shared_ptr<Module> module, int id);
+  void init() override;
+  CacheClass cache_class() const override { return cache_map; }
+  // also finds keys that have no entry yet
+  std::shared_ptr<Inode> lookup(const char *name) override;
+  int readdir_part(void *buf, fuse_fill_dir_t filler, std::unique_ptr<FileHandle> *cursor) override;
   int create(const char *name, mode_t mode, struct fuse_file_info *fi) override;
-  void * mod() const { return bpf_module_; }
+  int unlink(const char *name) override;
+  const Module & mod() const { return *module_; }
   int map_id() const { return id_; }
   int map_fd() const;
+  // Called by the refresher, returns the seconds until the next refresh,
+  // or a negative value if gen has been superseded by a newer schedule.
+  double scheduled_refresh(uint64_t gen);
+  void flush_evicted() override;
+  // Refresh every seconds from now on, or adapt to churn if 0.
+  void set_refresh_interval(double seconds);
+  double refresh_interval();
  private:
-  int refresh();
-  void *bpf_module_;
+  // a raw key, held by the entry it belongs to
+  struct KeyRef {
+    const uint8_t *data;
+    size_t size;
+    bool operator==(const KeyRef &other) const;
+  };
+  struct KeyHash {
+    size_t operator()(const KeyRef &key) const;
+  };
+  typedef std::unordered_map<KeyRef, MapEntry *, KeyHash> Index;
+  int refresh(size_t *churn);
+  void prefetch(const MapReader &reader, int n);
+  void touch(Inode *node);
+  // the raw key of name, if name is the one a listing gives it
+  bool parse_name(const char *name, std::string *key) const;
+  // the entry for raw key, made if there is none yet
+  std::shared_ptr<Inode> materialize(const std::string &key);
+  // callers of these hold refresh_mutex_
+  MapEntry * find_locked(const void *key) const;
+  void insert_locked(const std::string &name, std::shared_ptr<MapEntry> entry);
+  void erase_locked(MapEntry *entry, std::vector<std::shared_ptr<Inode>> *removed);
+  void evict_locked();
+  std::shared_ptr<Module> module_;
+  int id_;
+  // entries are carved from here, and it goes once the last of them does
+  std::shared_ptr<SlabPool> pool_;
+  // Guards everything below. Taken before lock_.
+  std::mutex refresh_mutex_;
+  // The entries that have been made, by raw key, at most map_entries of
+  // them besides those that are open. An entry holds its key, its place in
+  // lru_ and its slot in children_, where its name is; neither is copied.
+  Index index_;
+  // most recently used first
+  std::list<MapEntry *> lru_;
+  // evicted entries, with the names to invalidate before they go
+  std::vector<std::pair<std::string, std::shared_ptr<Inode>>> evicted_;
+  bool flush_pending_;
+  double interval_;
+  double fixed_interval_;
+  uint64_t sched_gen_;
+  // leaves by raw key, from the latest listing
+  std::unordered_map<std::string, std::string> prefetched_;
+  std::chrono::steady_clock::time_point prefetched_until_;
+};
+
+// Entries of a map named by the hex of their raw key, for consumers that
+// want neither libbcc's formatting nor its limits on names. Names are
+// listed straight from the map, and nodes are only made for names that are
+// looked up, at most map_entries of them.
+class MapRawDir : public Dir {
+ public:
+  MapRawDir(mode_t mode, std::shared_ptr<Module> module, int id);
+  CacheClass cache_class() const override { return cache_map; }
+  std::shared_ptr<Inode> lookup(const char *name) override;
+  int readdir_part(void *buf, fuse_fill_dir_t filler, std::unique_ptr<FileHandle> *cursor) override;
+  void flush_evicted() override;
+ private:
+  // with lru_mutex_ held
+  void evict_locked();
+  std::shared_ptr<Module> module_;
   int id_;
-  uint64_t last_ts_;
+  // Guards everything below. Taken before lock_.
+  std::mutex lru_mutex_;
+  // the nodes made, most recently used first
+  std::list<MapRawEntry *> lru_;
+  // evicted nodes, with the names to invalidate before they go
+  std::vector<std::pair<std::string, std::shared_ptr<Inode>>> evicted_;
+  bool flush_pending_;
 };
 
 class FunctionDir : public Dir {
  public:
-  FunctionDir(mode_t mode, void *bpf_module, int id);
+  FunctionDir(mode_t mode, std::shared_ptr<Module> module, int id);
+  void init() override;
   // load function and return open fd
   int load(const std::string &type);
   void unload();
+  // fd of the loaded function, closed once the last copy goes, or nullptr
+  std::shared_ptr<const int> prog_fd();
  private:
-  void *bpf_module_;
+  void unload_locked();
+  std::mutex mutex_;
+  std::shared_ptr<Module> module_;
   int id_;
+  std::shared_ptr<const int> prog_fd_;
+};
+
+// State of one open() of a file, kept in fh and deleted on release. It may
+// outlive the file itself.
+class FileHandle {
+ public:
+  virtual ~FileHandle() {}
 };
 
 class File : public Inode {
@@ -272,12 +664,15 @@ class File : public Inode {
   virtual int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) { return -EACCES; }
   virtual int truncate(off_t newsize) { return -EACCES; }
   virtual int flush(struct fuse_file_info *fi) { return 0; }
+  // Returns the ready events. A file that is not ready keeps notify and
+  // calls it once it is.
+  virtual unsigned poll(std::function<void()> notify);
  protected:
   virtual size_t size() const = 0;
   int read_helper(const std::string &data, char *buf, size_t size,
                   off_t offset, struct fuse_file_info *fi);
- private:
-  size_t size_;
+  // guards the contents of the file
+  mutable std::mutex mutex_;
 };
 
 class StringFile : public File {
@@ -288,7 +683,7 @@ class StringFile : public File {
   int truncate(off_t newsize) = 0;
   int flush(struct fuse_file_info *fi) = 0;
  protected:
-  size_t size() const { return data_.size(); }
+  size_t size() const;
   std::string data_;
 };
 
@@ -305,12 +700,44 @@ class SourceFile : public StringFile {
 class StatFile : public File {
  public:
   StatFile(const std::string &data) : File(), data_(data) {}
+  int open(struct fuse_file_info *fi) override;
   int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
 
-  void set_data(const std::string data) { data_ = data; }
+  void set_data(const std::string data);
+ protected:
+  size_t size() const override;
+  std::string data_;
+};
+
+// Progress of a background job. Reads without O_NONBLOCK, and poll(), wait
+// for the job to finish.
+class StatusFile : public StatFile {
+ public:
+  StatusFile(const std::string &data) : StatFile(data), pending_(false) {}
+  ~StatusFile();
+  unsigned poll(std::function<void()> notify) override;
+  // call fn with the contents once the job is done
+  void wait(std::function<void(const std::string &)> fn);
+  void set_pending(const std::string &data);
+  void set_done(const std::string &data);
+  bool pending() const;
+ private:
+  void wake();
+  bool pending_;
+  std::vector<std::function<void()>> pollers_;
+  std::vector<std::function<void(const std::string &)>> waiters_;
+};
+
+// Read-only file whose contents are generated on every open
+class InfoFile : public File {
+ public:
+  explicit InfoFile(std::function<std::string()> fn) : File(), fn_(fn) {}
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
  protected:
-  size_t size() const override { return data_.size(); }
+  size_t size() const override;
  private:
+  std::function<std::string()> fn_;
   std::string data_;
 };
 
@@ -321,22 +748,67 @@ class FunctionTypeFile : public StringFile {
   int flush(struct fuse_file_info *fi) override;
 };
 
+// Refresh interval of the parent map, in seconds, or "auto"
+class MapRefreshFile : public StringFile {
+ public:
+  MapRefreshFile() : StringFile(), dirty_(false) {}
+  int open(struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  int truncate(off_t newsize) override;
+  int flush(struct fuse_file_info *fi) override;
+ private:
+  bool dirty_;
+};
+
+struct DumpCursor;
+
+// Text dump of a map. Each open() gets a cursor that renders entries
+// straight into the read buffers as the map is walked, so memory does not
+// grow with the map. Reads that go back are restarted from the nearest
+// checkpoint (an offset and the key before it) recorded along the way. The
+// size is that of the latest dump read to the end.
 class MapDumpFile : public File {
  public:
-  MapDumpFile(void *bpf_module, int id);
+  MapDumpFile(std::shared_ptr<Module> module, int id);
+  CacheClass cache_class() const override { return cache_map; }
+  int open(struct fuse_file_info *fi) override;
   int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
   size_t size() const override;
  private:
-  void *bpf_module_;
+  int render(DumpCursor *c, char *buf, size_t size);
+  void rewind(DumpCursor *c, off_t offset);
+  std::shared_ptr<Module> module_;
   int id_;
   int fd_;
   size_t key_size_;
   size_t leaf_size_;
+  std::atomic<size_t> last_size_;
+};
+
+// Binary dump of a map, for consumers that want the raw entries. Each
+// open() takes a snapshot: a struct bcc_dump_header (see client.h) with
+// the layout and the number of entries, then the raw records.
+class MapBinaryDumpFile : public File {
+ public:
+  MapBinaryDumpFile(std::shared_ptr<Module> module, int id);
+  CacheClass cache_class() const override { return cache_map; }
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  size_t size() const override;
+ private:
+  std::shared_ptr<Module> module_;
+  int id_;
+  std::atomic<size_t> last_size_;
 };
 
+// One entry of a map. Kept small, since a map directory may hold
+// thousands: keys up to inline_key bytes are stored in the entry itself,
+// and a value handed over by a listing is only formatted once asked for.
 class MapEntry : public StringFile {
  public:
-  MapEntry(std::unique_ptr<uint8_t[]> key, size_t leaf_size);
+  MapEntry(std::shared_ptr<Module> module, int id, const void *key);
+  ~MapEntry();
+  CacheClass cache_class() const override { return cache_value; }
   int getattr(struct stat *st) override;
   int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
   int open(struct fuse_file_info *fi) override;
@@ -344,12 +816,59 @@ class MapEntry : public StringFile {
   int truncate(off_t newsize) override;
   int flush(struct fuse_file_info *fi) override;
   int unlink() override;
+  // Take leaf as the value, without looking it up again, until expires,
+  // unless the value is being written.
+  void prefetched(const uint8_t *leaf, std::chrono::steady_clock::time_point expires);
+  // open handles keep the entry in its directory
+  void pin(bool write) { ++pins_; writers_ += write; }
+  void unpin(bool write) { --pins_; writers_ -= write; }
+  bool pinned() const { return pins_ > 0; }
+  static const size_t inline_key = 16;
  private:
+  friend class MapDir;
   int refresh();
-  std::unique_ptr<uint8_t[]> key_;
-  size_t key_size_;
-  size_t leaf_size_;
+  // turn a raw value in data_ into text, with mutex_ held
+  int format_locked();
+  // written to and not yet flushed, or open for writing
+  bool writing_locked() const { return dirty_ || writers_ > 0; }
+  size_t key_size() const { return module_->key_size(id_); }
+  size_t leaf_size() const { return module_->leaf_size(id_); }
+  uint8_t * key_data() { return key_size() <= inline_key ? key_inline_ : key_heap_; }
+  const uint8_t * key_data() const { return key_size() <= inline_key ? key_inline_ : key_heap_; }
+  std::shared_ptr<Module> module_;
+  int id_;
+  union {
+    uint8_t key_inline_[inline_key];
+    uint8_t *key_heap_;
+  };
   bool dirty_;
+  // data_ holds the value as read from the map, not yet formatted
+  bool raw_;
+  std::atomic<int> pins_;
+  std::atomic<int> writers_;
+  std::chrono::steady_clock::time_point fresh_until_;
+  // set by MapDir while the entry is in its index
+  std::list<MapEntry *>::iterator lru_;
+  Dir::Children::iterator child_;
+};
+
+// The raw leaf of one map entry
+class MapRawEntry : public File {
+ public:
+  MapRawEntry(std::shared_ptr<Module> module, int id, std::string key);
+  CacheClass cache_class() const override { return cache_value; }
+  int getattr(struct stat *st) override;
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  size_t size() const override;
+ private:
+  friend class MapRawDir;
+  std::shared_ptr<Module> module_;
+  int id_;
+  std::string key_;
+  // its place in the directory's lru_
+  std::list<MapRawEntry *>::iterator lru_;
 };
 
 }  // namespace bcc
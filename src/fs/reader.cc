@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <bcc/libbpf.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "module.h"
+
+namespace bcc {
+
+namespace {
+
+// BPF_MAP_LOOKUP_BATCH and its attributes, spelled out here since the
+// uapi headers we build against may predate them (linux 5.6)
+const int bpf_map_lookup_batch = 24;
+
+struct batch_attr {
+  uint64_t in_batch;
+  uint64_t out_batch;
+  uint64_t keys;
+  uint64_t values;
+  uint32_t count;
+  uint32_t map_fd;
+  uint64_t elem_flags;
+  uint64_t flags;
+};
+
+// for kernels without the command
+const int enotsupp = 524;
+
+}  // namespace
+
+MapReader::MapReader(int fd, size_t key_size, size_t leaf_size, size_t batch_size,
+                     bool leaves)
+    : fd_(fd), key_size_(key_size), leaf_size_(leaf_size),
+    batch_size_(batch_size ? batch_size : 1), want_leaves_(leaves), batched_(batch_size > 1),
+    started_(false), done_(false), syscalls_(0) {
+  keys_.resize(batch_size_ * key_size_);
+  leaves_.resize(batch_size_ * leaf_size_);
+  // hash maps keep a 4 byte bucket index here, others the last key
+  cursor_.resize(std::max(key_size_, sizeof(uint64_t)));
+}
+
+int MapReader::next() {
+  if (done_)
+    return 0;
+  if (batched_) {
+    int rc = next_batch();
+    if (rc != -EINVAL && rc != -enotsupp)
+      return rc;
+    // not for this kernel or map type, and nothing was read yet
+    batched_ = false;
+  }
+  return next_key();
+}
+
+void MapReader::seek(const uint8_t *key) {
+  memcpy(&cursor_[0], key, key_size_);
+  batched_ = false;
+  started_ = true;
+  done_ = false;
+}
+
+int MapReader::next_batch() {
+  struct batch_attr attr;
+  int rc;
+  for (;;) {
+    memset(&attr, 0, sizeof(attr));
+    attr.in_batch = started_ ? (uintptr_t)&cursor_[0] : 0;
+    attr.out_batch = (uintptr_t)&cursor_[0];
+    attr.keys = (uintptr_t)&keys_[0];
+    attr.values = (uintptr_t)&leaves_[0];
+    attr.count = keys_.size() / key_size_;
+    attr.map_fd = fd_;
+    ++syscalls_;
+    rc = syscall(__NR_bpf, bpf_map_lookup_batch, &attr, sizeof(attr));
+    if (rc == 0 || errno != ENOSPC)
+      break;
+    // A hash bucket holds more entries than fit, and is only returned
+    // whole. Nothing was read, so try the same bucket with more room.
+    keys_.resize(keys_.size() * 2);
+    leaves_.resize(leaves_.size() * 2);
+  }
+  if (rc < 0 && errno == ENOENT) {
+    // the last batch, possibly empty
+    done_ = true;
+    return attr.count;
+  }
+  if (rc < 0)
+    return started_ ? -EIO : -errno;
+  started_ = true;
+  return attr.count;
+}
+
+int MapReader::next_key() {
+  if (!started_) {
+    memset(&cursor_[0], 0, key_size_);
+    started_ = true;
+  }
+  size_t n = 0;
+  while (n < batch_size_) {
+    ++syscalls_;
+    if (bpf_get_next_key(fd_, &cursor_[0], &cursor_[0])) {
+      done_ = true;
+      break;
+    }
+    if (want_leaves_) {
+      ++syscalls_;
+      // an entry deleted in between is simply skipped
+      if (bpf_lookup_elem(fd_, &cursor_[0], &leaves_[n * leaf_size_]))
+        continue;
+    }
+    memcpy(&keys_[n * key_size_], &cursor_[0], key_size_);
+    ++n;
+  }
+  return n;
+}
+
+}  // namespace bcc
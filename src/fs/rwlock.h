@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+namespace bcc {
+
+// Reader/writer lock, until we can rely on std::shared_timed_mutex (C++14).
+// Works with std::lock_guard for the exclusive side.
+class RWLock {
+ public:
+  RWLock() { pthread_rwlock_init(&lock_, nullptr); }
+  ~RWLock() { pthread_rwlock_destroy(&lock_); }
+  RWLock(const RWLock &) = delete;
+  void lock() { pthread_rwlock_wrlock(&lock_); }
+  void unlock() { pthread_rwlock_unlock(&lock_); }
+  void lock_shared() { pthread_rwlock_rdlock(&lock_); }
+  void unlock_shared() { pthread_rwlock_unlock(&lock_); }
+ private:
+  pthread_rwlock_t lock_;
+};
+
+class ReadLock {
+ public:
+  explicit ReadLock(RWLock &lock) : lock_(lock) { lock_.lock_shared(); }
+  ~ReadLock() { lock_.unlock_shared(); }
+  ReadLock(const ReadLock &) = delete;
+ private:
+  RWLock &lock_;
+};
+
+class WriteLock {
+ public:
+  explicit WriteLock(RWLock &lock) : lock_(lock) { lock_.lock(); }
+  ~WriteLock() { lock_.unlock(); }
+  WriteLock(const WriteLock &) = delete;
+ private:
+  RWLock &lock_;
+};
+
+}  // namespace bcc
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace bcc {
+
+// Allocations of one size carved from large chunks, for the many small
+// nodes of one directory. Freed slots are reused, and the chunks are only
+// given back, all at once, when the pool goes. Other sizes go to the heap.
+class SlabPool {
+ public:
+  explicit SlabPool(size_t per_chunk = 256)
+      : per_chunk_(per_chunk), slot_size_(0), free_(nullptr) {}
+  SlabPool(const SlabPool &) = delete;
+
+  void * allocate(size_t size) {
+    size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!slot_size_)
+      slot_size_ = size;
+    if (size != slot_size_)
+      return ::operator new(size);
+    if (!free_) {
+      chunks_.emplace_back(new char[slot_size_ * per_chunk_]);
+      char *chunk = chunks_.back().get();
+      for (size_t i = per_chunk_; i > 0; --i)
+        push(chunk + (i - 1) * slot_size_);
+    }
+    Slot *slot = free_;
+    free_ = slot->next;
+    return slot;
+  }
+
+  void deallocate(void *p, size_t size) {
+    size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (size != slot_size_) {
+      ::operator delete(p);
+      return;
+    }
+    push(p);
+  }
+
+ private:
+  struct Slot {
+    Slot *next;
+  };
+  void push(void *p) {
+    Slot *slot = static_cast<Slot *>(p);
+    slot->next = free_;
+    free_ = slot;
+  }
+  std::mutex mutex_;
+  size_t per_chunk_;
+  size_t slot_size_;
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  Slot *free_;
+};
+
+// Allocator on a shared SlabPool, for std::allocate_shared. Every object
+// (and so every copy of the allocator) keeps the pool alive.
+template <class T>
+class SlabAllocator {
+ public:
+  typedef T value_type;
+  explicit SlabAllocator(std::shared_ptr<SlabPool> pool) : pool_(std::move(pool)) {}
+  template <class U>
+  SlabAllocator(const SlabAllocator<U> &other) : pool_(other.pool_) {}
+  T * allocate(size_t n) { return static_cast<T *>(pool_->allocate(n * sizeof(T))); }
+  void deallocate(T *p, size_t n) { pool_->deallocate(p, n * sizeof(T)); }
+  template <class U>
+  bool operator==(const SlabAllocator<U> &other) const { return pool_ == other.pool_; }
+  template <class U>
+  bool operator!=(const SlabAllocator<U> &other) const { return pool_ != other.pool_; }
+ private:
+  template <class U> friend class SlabAllocator;
+  std::shared_ptr<SlabPool> pool_;
+};
+
+}  // namespace bcc
@@ -14,21 +14,29 @@
  * limitations under the License.
  */
 
+#include <cstdlib>
 #include <cstring>
-#include <future>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <unistd.h>
 
-#include "client.h"
 #include "mount.h"
-#include "string_util.h"
 
+using std::move;
+using std::mutex;
+using std::shared_ptr;
 using std::string;
-using std::thread;
+using std::unique_lock;
+using std::vector;
 
 namespace bcc {
 
+// fds sent per message on the control socket
+static const size_t max_fds_per_msg = 64;
+
 Socket::Socket(mode_t mode, dev_t rdev)
   : Inode(socket_e, mode), rdev_(rdev) {
 }
@@ -39,60 +47,339 @@ int Socket::getattr(struct stat *st) {
   return 0;
 }
 
-FDSocket::~FDSocket() {
-  close(fd_);
-  if (sock_ >= 0) {
-    shutdown(sock_, SHUT_RDWR);
-    close(sock_);
+// A listening socket bound at path, or a negative errno
+static int listen_at(const string &path, int backlog) {
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path))
+    return -ENAMETOOLONG;
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -errno;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  if (::bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      ::listen(sock, backlog) < 0) {
+    int err = -errno;
+    close(sock);
+    return err;
+  }
+  return sock;
+}
+
+// Sends len bytes of data along with fds, without waiting on the peer.
+// Returns the bytes sent, which may be short, or a negative errno.
+static ssize_t send_fds(int conn, const void *data, size_t len, const int *fds, size_t nfds) {
+  union {
+    struct cmsghdr cmsghdr;
+    char control[CMSG_SPACE(sizeof(int) * max_fds_per_msg)];
+  } cmsgu;
+  struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds) {
+    msg.msg_control = cmsgu.control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+
+  ssize_t sent = sendmsg(conn, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0)
+    return -errno;
+  return sent;
+}
+
+// The fd to hand out for node, a map or loaded function, along with what
+// keeps it open
+static int node_fd(const shared_ptr<Inode> &node, shared_ptr<const void> *hold) {
+  if (auto map = std::dynamic_pointer_cast<MapDir>(node)) {
+    // the map is closed with the module, which the directory holds on to
+    *hold = map;
+    return map->map_fd();
+  }
+  if (auto function = std::dynamic_pointer_cast<FunctionDir>(node)) {
+    shared_ptr<const int> fd = function->prog_fd();
+    if (!fd)
+      return -ENOENT;
+    *hold = fd;
+    return *fd;
+  }
+  return -EINVAL;
+}
+
+FdServer::FdServer()
+    : epoll_fd_(-1), wake_fd_(-1), control_(-1), stop_(false) {
+}
+
+FdServer::~FdServer() {
+  stop();
+}
+
+int FdServer::start(int backlog, const string &path) {
+  int err = 0;
+  {
+    unique_lock<mutex> guard(mutex_);
+    if (thread_.joinable())
+      return 0;
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || wake_fd_ < 0 || watch(wake_fd_, EPOLLIN, EPOLL_CTL_ADD) < 0)
+      err = -errno;
+    else if (!(err = bind_control(path, backlog)) && watch(control_, EPOLLIN, EPOLL_CTL_ADD) < 0)
+      err = -errno;
+    if (!err) {
+      stop_ = false;
+      thread_ = std::thread(&FdServer::run, this);
+      return 0;
+    }
+  }
+  stop();
+  return err;
+}
+
+void FdServer::stop() {
+  {
+    unique_lock<mutex> guard(mutex_);
+    stop_ = true;
+    if (wake_fd_ >= 0)
+      wake();
+  }
+  if (thread_.joinable())
+    thread_.join();
+  unique_lock<mutex> guard(mutex_);
+  for (auto &it : conns_)
+    close(it.first);
+  conns_.clear();
+  if (control_ >= 0)
+    close(control_);
+  control_ = -1;
+  if (!path_.empty())
+    unlink(path_.c_str());
+  if (!dir_.empty())
+    rmdir(dir_.c_str());
+  path_.clear();
+  dir_.clear();
+  if (epoll_fd_ >= 0)
+    close(epoll_fd_);
+  if (wake_fd_ >= 0)
+    close(wake_fd_);
+  epoll_fd_ = wake_fd_ = -1;
+}
+
+void FdServer::wake() {
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+int FdServer::watch(int sock, uint32_t events, int op) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = sock;
+  if (epoll_ctl(epoll_fd_, op, sock, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+int FdServer::bind_control(const string &path, int backlog) {
+  string at = path;
+  if (at.empty()) {
+    // Nobody else can create or replace names in a directory made here,
+    // unlike in the mount or a shared directory.
+    const char *base = getenv("XDG_RUNTIME_DIR");
+    string dir = string(base && *base ? base : "/tmp") + "/bcc-fuser.XXXXXX";
+    if (!mkdtemp(&dir[0]))
+      return -errno;
+    chmod(dir.c_str(), 0755);
+    dir_ = dir;
+    at = dir + "/control";
+  } else {
+    // left behind by a daemon that did not stop cleanly
+    struct stat st;
+    if (!lstat(at.c_str(), &st) && S_ISSOCK(st.st_mode))
+      unlink(at.c_str());
   }
-  thread_.join();
+  int sock = listen_at(at, backlog);
+  if (sock < 0)
+    return sock;
+  path_ = at;
+  // connecting takes write permission; anyone who sees the mount may ask
+  chmod(at.c_str(), 0666);
+  control_ = sock;
+  return 0;
 }
 
-FDSocket::FDSocket(mode_t mode, dev_t rdev, int fd)
-    : Socket(mode, rdev), fd_(fd), sock_(-1), ready_(false) {
-  auto fn = [&] () {
+string FdServer::control_path() {
+  unique_lock<mutex> guard(mutex_);
+  return path_;
+}
 
-    sock_ = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock_ < 0) {
-      perror("socket");
+void FdServer::accept_control() {
+  for (;;) {
+    int conn = accept4(control_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
       return;
     }
+    if (watch(conn, EPOLLIN, EPOLL_CTL_ADD) < 0)
+      close(conn);
+    else
+      conns_[conn] = Conn();
+  }
+}
 
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, path().c_str(), sizeof(addr.sun_path));
+void FdServer::close_control(int conn) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn, nullptr);
+  close(conn);
+  conns_.erase(conn);
+}
 
-    ::unlink(addr.sun_path);
-    if (bind(sock_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-      perror("bind");
-      close(sock_);
+void FdServer::read_control(int conn) {
+  Conn &c = conns_[conn];
+  char buf[4096];
+  for (;;) {
+    ssize_t n = read(conn, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      c.eof = true;
+      break;
+    }
+    if (c.in.size() + n > max_request) {
+      close_control(conn);
       return;
     }
+    c.in.append(buf, n);
+  }
+  process_control(conn);
+}
+
+void FdServer::write_control(int conn) {
+  if (flush_control(conn))
+    process_control(conn);
+}
 
-    if (listen(sock_, 1) < 0) {
-      perror("listen");
-      close(sock_);
+void FdServer::process_control(int conn) {
+  Conn &c = conns_[conn];
+  // Requests are a line per path, ended by an empty line. Take the next
+  // one only once the replies so far are out, so that a client that does
+  // not read them stops being read from.
+  while (c.out.empty()) {
+    size_t end = c.in.compare(0, 1, "\n") ? c.in.find("\n\n") : 0;
+    if (end == string::npos)
+      break;
+    vector<string> paths;
+    for (size_t pos = 0; pos < end;) {
+      size_t eol = c.in.find('\n', pos);
+      paths.push_back(c.in.substr(pos, eol - pos));
+      pos = eol + 1;
+    }
+    c.in.erase(0, end ? end + 2 : 1);
+    reply_control(c, paths);
+    if (!flush_control(conn))
+      return;
+  }
+  if (c.out.empty() && c.eof) {
+    close_control(conn);
+    return;
+  }
+  // wait for room to write, or for more to read
+  bool writing = !c.out.empty();
+  if (writing != c.writing) {
+    if (watch(conn, writing ? EPOLLOUT : EPOLLIN, EPOLL_CTL_MOD) < 0) {
+      close_control(conn);
       return;
     }
+    c.writing = writing;
+  }
+}
 
-    bcc_send_fd(sock_, fd_);
-  };
-  // todo: make this lighter weight - select loop and/or on-demand
-  thread_ = thread(fn);
+void FdServer::reply_control(Conn &c, const vector<string> &paths) {
+  Message m;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    shared_ptr<Inode> node = Mount::instance()->resolve(paths[i].c_str());
+    shared_ptr<const void> hold;
+    int fd = node ? node_fd(node, &hold) : -ENOENT;
+    m.status.push_back(fd < 0 ? fd : 0);
+    if (fd >= 0) {
+      m.fds.push_back(fd);
+      m.hold.push_back(move(hold));
+    }
+    // at most max_fds_per_msg fds per message, and the rest of the status
+    // with the last one
+    if (m.fds.size() == max_fds_per_msg || i + 1 == paths.size()) {
+      c.out.push_back(move(m));
+      m = Message();
+    }
+  }
 }
 
-int FDSocket::getattr(struct stat *st) {
-  if (!ready_)
-    return -ENOENT;
-  return Socket::getattr(st);
+bool FdServer::flush_control(int conn) {
+  Conn &c = conns_[conn];
+  while (!c.out.empty()) {
+    Message &m = c.out.front();
+    size_t len = m.status.size() * sizeof(int32_t);
+    const char *data = (const char *)m.status.data() + m.sent;
+    // the fds go with the first byte, and the rest of a short write after
+    ssize_t n = m.sent ? send_fds(conn, data, len - m.sent, nullptr, 0)
+                       : send_fds(conn, data, len, m.fds.data(), m.fds.size());
+    if (n == -EAGAIN || n == -EWOULDBLOCK)
+      return true;
+    if (n < 0) {
+      close_control(conn);
+      return false;
+    }
+    m.sent += n;
+    if (m.sent == len)
+      c.out.pop_front();
+  }
+  return true;
 }
 
-int FDSocket::mknod() {
-  if (ready_)
-    return -EEXIST;
-  ready_ = true;
-  return 0;
+void FdServer::run() {
+  struct epoll_event events[64];
+  for (;;) {
+    int n = epoll_wait(epoll_fd_, events, 64, -1);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      return;
+    }
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd_) {
+        uint64_t count;
+        if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          perror("eventfd");
+      } else if (fd == control_) {
+        accept_control();
+      } else if (conns_.count(fd)) {
+        // errors and hangups show up on the next read or write
+        if (conns_[fd].writing)
+          write_control(fd);
+        else
+          read_control(fd);
+      }
+    }
+    unique_lock<mutex> guard(mutex_);
+    if (stop_)
+      return;
+  }
 }
 
 }  // namespace bcc
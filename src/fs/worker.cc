@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mount.h"
+
+using std::chrono::steady_clock;
+using std::function;
+using std::move;
+using std::mutex;
+using std::unique_lock;
+using std::weak_ptr;
+
+namespace bcc {
+
+WorkerPool::WorkerPool() : stop_(false) {
+}
+
+WorkerPool::~WorkerPool() {
+  stop();
+}
+
+void WorkerPool::start(size_t nthreads) {
+  unique_lock<mutex> guard(mutex_);
+  stop_ = false;
+  for (size_t i = 0; i < nthreads; ++i)
+    threads_.emplace_back(&WorkerPool::run, this);
+}
+
+void WorkerPool::stop() {
+  {
+    unique_lock<mutex> guard(mutex_);
+    stop_ = true;
+    jobs_.clear();
+  }
+  cond_.notify_all();
+  for (auto &t : threads_)
+    t.join();
+  threads_.clear();
+}
+
+bool WorkerPool::submit(function<void()> fn) {
+  {
+    unique_lock<mutex> guard(mutex_);
+    if (threads_.empty() || stop_)
+      return false;
+    jobs_.push_back(move(fn));
+  }
+  cond_.notify_one();
+  return true;
+}
+
+void WorkerPool::run() {
+  unique_lock<mutex> guard(mutex_);
+  for (;;) {
+    cond_.wait(guard, [this] () { return stop_ || !jobs_.empty(); });
+    if (stop_)
+      return;
+    function<void()> fn = move(jobs_.front());
+    jobs_.pop_front();
+    guard.unlock();
+    fn();
+    // drop whatever the job captured before taking the lock again
+    fn = nullptr;
+    guard.lock();
+  }
+}
+
+Refresher::Refresher() : stop_(false) {
+}
+
+Refresher::~Refresher() {
+  stop();
+}
+
+void Refresher::start() {
+  unique_lock<mutex> guard(mutex_);
+  stop_ = false;
+  if (!thread_.joinable())
+    thread_ = std::thread(&Refresher::run, this);
+}
+
+void Refresher::stop() {
+  {
+    unique_lock<mutex> guard(mutex_);
+    stop_ = true;
+    jobs_ = decltype(jobs_)();
+  }
+  cond_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void Refresher::schedule(weak_ptr<MapDir> dir, double delay, uint64_t gen) {
+  auto due = steady_clock::now() +
+      std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(delay));
+  push(Job{due, move(dir), gen});
+}
+
+void Refresher::flush(weak_ptr<Dir> dir) {
+  // generation 0 is no schedule, just this once
+  push(Job{steady_clock::now(), move(dir), 0});
+}
+
+void Refresher::push(Job job) {
+  {
+    unique_lock<mutex> guard(mutex_);
+    if (stop_)
+      return;
+    jobs_.push(move(job));
+  }
+  // only matters if this job is now the first one due
+  cond_.notify_one();
+}
+
+void Refresher::run() {
+  unique_lock<mutex> guard(mutex_);
+  for (;;) {
+    if (stop_)
+      return;
+    if (jobs_.empty()) {
+      cond_.wait(guard);
+      continue;
+    }
+    // an earlier job may be scheduled meanwhile, so look again after waking
+    steady_clock::time_point due = jobs_.top().due;
+    if (due > steady_clock::now()) {
+      cond_.wait_until(guard, due);
+      continue;
+    }
+    Job job = jobs_.top();
+    jobs_.pop();
+    guard.unlock();
+    // a directory that was removed or rescheduled meanwhile drops out
+    if (auto dir = job.dir.lock()) {
+      if (!job.gen) {
+        dir->flush_evicted();
+      } else {
+        auto map = std::static_pointer_cast<MapDir>(dir);
+        dir.reset();
+        double delay = map->scheduled_refresh(job.gen);
+        weak_ptr<MapDir> next = map;
+        map.reset();
+        if (delay >= 0)
+          schedule(move(next), delay, job.gen);
+      }
+    }
+    guard.lock();
+  }
+}
+
+}  // namespace bcc
@@ -22,6 +22,9 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace bcc {
 
@@ -45,6 +48,56 @@ make_unique(Args &&... args) {
   return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
+// Writes the 2 * n lowercase hex digits of src to dst, not terminated
+static inline
+void hex_encode(const uint8_t *src, size_t n, char *dst) {
+  static const char digits[] = "0123456789abcdef";
+  size_t i = 0;
+#ifdef __SSE2__
+  // 16 bytes at a time: split into nibbles, interleave high and low, and
+  // map 0-9 to '0'-'9' and 10-15 to 'a'-'f'
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+  for (; i + 16 <= n; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_and_si128(in, mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+    __m128i a = _mm_unpacklo_epi8(hi, lo);
+    __m128i b = _mm_unpackhi_epi8(hi, lo);
+    a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), gap));
+    b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), gap));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), a);
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), b);
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[2 * i] = digits[src[i] >> 4];
+    dst[2 * i + 1] = digits[src[i] & 0xf];
+  }
+}
+
+// Reads 2 * n lowercase hex digits from src, returns false on anything else
+static inline
+bool hex_decode(const char *src, size_t n, uint8_t *dst) {
+  for (size_t i = 0; i < 2 * n; ++i) {
+    char c = src[i];
+    int v;
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else
+      return false;
+    if (i % 2)
+      dst[i / 2] |= v;
+    else
+      dst[i / 2] = v << 4;
+  }
+  return true;
+}
+
 class Path {
  public:
   explicit Path(const char *path)
@@ -6,16 +6,18 @@ import fcntl
 import os
 from subprocess import call
 import sys
-import time
 
 bcc = ctypes.CDLL("libbccclient.so")
 bcc.bcc_recv_fd.restype = int
 bcc.bcc_recv_fd.argtypes = [ctypes.c_char_p]
+bcc.bcc_recv_fds.restype = int
+bcc.bcc_recv_fds.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.c_char_p),
+                             ctypes.POINTER(ctypes.c_int), ctypes.c_int]
 
 if not os.path.exists("/run/bcc"):
     os.mkdir("/run/bcc")
 
-call(["bcc-fuser", "-s", "/run/bcc"])
+call(["bcc-fuser", "/run/bcc"])
 
 if not os.path.exists("/run/bcc/foo"):
     os.mkdir("/run/bcc/foo")
@@ -28,6 +30,9 @@ int hello(void *ctx) {
     return 0;
 }
 """)
+# compiles run in the background, status blocks until this one is done
+with open("/run/bcc/foo/status") as f:
+    print("Compile: %s" % f.read().strip())
 try:
     with open("/run/bcc/foo/functions/hello/type", "w") as f:
         f.write('kprobe')
@@ -48,14 +53,33 @@ int hello(void *ctx) {
     return 0;
 }
 """)
+with open("/run/bcc/foo/status") as f:
+    if f.read() != "loaded\n": raise Exception("compile failed")
 
 with open("/run/bcc/foo/functions/hello/type", "w") as f:
     f.write('kprobe')
 
-# Pause here due to fuse race condition, TBD soon
-time.sleep(0.2)
-fd = bcc.bcc_recv_fd(b"/run/bcc/foo/functions/hello/fd")
+# the fd is there as soon as the write of type returns
+fd = bcc.bcc_recv_fd(b"/run/bcc/foo/functions/hello")
 
 if fd < 0: raise Exception("invalid fd %d" % fd)
 
+# the same, along with the map's, in one request
+paths = (ctypes.c_char_p * 3)(b"foo/functions/hello", b"foo/maps/stats", b"foo/nope")
+fds = (ctypes.c_int * 3)()
+if bcc.bcc_recv_fds(b"/run/bcc", paths, fds, 3) != 0: raise Exception("bcc_recv_fds failed")
+if fds[0] < 0 or fds[1] < 0: raise Exception("invalid fds %d %d" % (fds[0], fds[1]))
+if fds[2] >= 0: raise Exception("fd %d for a missing path" % fds[2])
+
+# two requests on one connection, before reading either reply
+bcc.bcc_fd_request.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_char_p), ctypes.c_int]
+bcc.bcc_fd_reply.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_int), ctypes.c_int]
+sock = bcc.bcc_fd_connect(b"/run/bcc")
+if sock < 0: raise Exception("bcc_fd_connect failed")
+if bcc.bcc_fd_request(sock, paths, 2) or bcc.bcc_fd_request(sock, paths, 1):
+    raise Exception("bcc_fd_request failed")
+if bcc.bcc_fd_reply(sock, fds, 2) or bcc.bcc_fd_reply(sock, fds, 1) or min(fds[0], fds[1]) < 0:
+    raise Exception("bcc_fd_reply failed")
+os.close(sock)
+
 call(["killall", "bcc-fuser"])
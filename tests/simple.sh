@@ -9,10 +9,21 @@ D=/tmp/bcc
 
 sudo mkdir -p $D/foo
 echo -e 'BPF_TABLE("array", int, int, bar, 10);\nint hello(void *ctx) { return 0; }' | sudo tee $D/foo/source
+[[ $(sudo cat $D/foo/status) = "loaded" ]] || fail "foo/status != loaded"
 [[ $(sudo cat $D/foo/valid) = "1" ]] || fail "foo/valid != 1"
-[[ $(sudo cat $D/foo/maps/bar/fd) -ge 0 ]] || fail "foo/maps/bar/fd < 0"
+sudo test -S $D/.control || fail ".control is not a socket"
+[[ $(sudo cat $D/foo/maps/bar/refresh) = "auto" ]] || fail "foo/maps/bar/refresh != auto"
+echo 30 | sudo tee $D/foo/maps/bar/refresh
+[[ $(sudo cat $D/foo/maps/bar/refresh) = "30" ]] || fail "foo/maps/bar/refresh != 30"
+
+# the same source elsewhere is served from the module cache
+sudo mkdir -p $D/foo2
+sudo cp $D/foo/source $D/foo2/source
+[[ $(sudo cat $D/foo2/status) = "loaded" ]] || fail "foo2/status != loaded"
+sudo grep -q "module_cache_hits=[1-9]" $D/.stats || fail "no module cache hit"
 
 sudo mkdir -p $D/fuz
 echo -e 'BPF_TABLE("array", int, int, baz, 10);\nint hello(void *ctx) { return 0; }' | sudo tee $D/fuz/source
+sudo cat $D/fuz/status
 echo "filter" | sudo tee $D/fuz/functions/hello/type
 